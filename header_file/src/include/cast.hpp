@@ -62,6 +62,35 @@ inline T DecimalCastHelper(S input, int width, int scale) {
   return output;
 }
 
+/**
+ * Non-throwing version of ErrorCastHelper, records the error in error
+ */
+template <typename S, typename T, typename op>
+inline T TryErrorCastHelper(S input, UDFErrorState &error) {
+  T output = T();
+  std::string error_message;
+  op::template Operation<S, T>(input, output, &error_message);
+  if (!error_message.empty()) {
+    error.SetError(error_message);
+  }
+  return output;
+}
+
+/**
+ * Non-throwing version of DecimalCastHelper, records the error in error
+ */
+template <typename S, typename T, typename op>
+inline T TryDecimalCastHelper(S input, int width, int scale,
+                              UDFErrorState &error) {
+  T output = T();
+  std::string error_message;
+  op::template Operation<S, T>(input, output, &error_message, width, scale);
+  if (!error_message.empty()) {
+    error.SetError(error_message);
+  }
+  return output;
+}
+
 // udf_todo
 
 /**
@@ -1,3 +1,4 @@
+#include "functions.hpp"
 #include "duckdb/core_functions/scalar/date_functions.hpp"
 #include "duckdb/common/types/interval.hpp"
 #include "duckdb/common/operator/multiply.hpp"
@@ -113,4 +114,64 @@ struct ToMicroSecondsOperator {
 		return result;
 	}
 };
+/**
+ * Non-throwing versions of the to interval functions that can overflow,
+ * record the error in error
+ */
+struct TryToYearsOperator {
+	template <class TA, class TR>
+	static inline TR Operation(TA input, UDFErrorState &error) {
+		interval_t result;
+		result.days = 0;
+		result.micros = 0;
+		if (!TryMultiplyOperator::Operation<int32_t, int32_t, int32_t>(input, Interval::MONTHS_PER_YEAR,
+		                                                               result.months)) {
+			error.SetError(StringUtil::Format("Interval value %d years out of range", input),
+			               UDFErrorKind::OUT_OF_RANGE);
+			result.months = 0;
+		}
+		return result;
+	}
+};
+
+template <class TA>
+static inline interval_t TryToMicrosInterval(TA input, int64_t factor, const char *unit, UDFErrorState &error) {
+	interval_t result;
+	result.months = 0;
+	result.days = 0;
+	if (!TryMultiplyOperator::Operation<int64_t, int64_t, int64_t>(input, factor, result.micros)) {
+		error.SetError(StringUtil::Format("Interval value %d %s out of range", input, unit),
+		               UDFErrorKind::OUT_OF_RANGE);
+		result.micros = 0;
+	}
+	return result;
+}
+
+struct TryToHoursOperator {
+	template <class TA, class TR>
+	static inline TR Operation(TA input, UDFErrorState &error) {
+		return TryToMicrosInterval(input, Interval::MICROS_PER_HOUR, "hours", error);
+	}
+};
+
+struct TryToMinutesOperator {
+	template <class TA, class TR>
+	static inline TR Operation(TA input, UDFErrorState &error) {
+		return TryToMicrosInterval(input, Interval::MICROS_PER_MINUTE, "minutes", error);
+	}
+};
+
+struct TryToSecondsOperator {
+	template <class TA, class TR>
+	static inline TR Operation(TA input, UDFErrorState &error) {
+		return TryToMicrosInterval(input, Interval::MICROS_PER_SEC, "seconds", error);
+	}
+};
+
+struct TryToMilliSecondsOperator {
+	template <class TA, class TR>
+	static inline TR Operation(TA input, UDFErrorState &error) {
+		return TryToMicrosInterval(input, Interval::MICROS_PER_MSEC, "milliseconds", error);
+	}
+};
 }
\ No newline at end of file
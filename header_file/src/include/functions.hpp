@@ -3,6 +3,7 @@
 #include "duckdb/common/types/string_type.hpp"
 #include "duckdb/common/types/vector.hpp"
 #include "duckdb/common/types/cast_helpers.hpp"
+#include "duckdb/common/exception.hpp"
 
 using namespace duckdb;
 namespace udf{
@@ -22,4 +23,45 @@ SRCTYPE AddOperation(SRCTYPE left, SRCTYPE right);
 
 string_t int_to_string(int32_t input, Vector &vector);
 
-}
\ No newline at end of file
+}
+
+/**
+ * The kind of exception DuckDB raises for an error
+ */
+enum class UDFErrorKind { RUNTIME, CAST, OUT_OF_RANGE, NOT_IMPLEMENTED };
+
+/**
+ * Error state of one chunk for the exception-free code generation mode
+ * Helpers record the first error here instead of throwing inside the row loop,
+ * the exception is raised once by Throw after the loop
+ */
+struct UDFErrorState {
+  bool has_error = false;
+  UDFErrorKind kind = UDFErrorKind::RUNTIME;
+  std::string message;
+
+  inline void SetError(const std::string &error_message,
+                       UDFErrorKind error_kind = UDFErrorKind::RUNTIME) {
+    if (!has_error) {
+      has_error = true;
+      kind = error_kind;
+      message = error_message;
+    }
+  }
+
+  void Throw() const {
+    if (!has_error) {
+      return;
+    }
+    switch (kind) {
+    case UDFErrorKind::CAST:
+      throw CastException(message);
+    case UDFErrorKind::OUT_OF_RANGE:
+      throw OutOfRangeException(message);
+    case UDFErrorKind::NOT_IMPLEMENTED:
+      throw NotImplementedException(message);
+    default:
+      throw std::runtime_error(message);
+    }
+  }
+};
@@ -41,6 +41,8 @@
  */
 // already included by divide
 
+#include "duckdb/common/operator/cast_operators.hpp"
+
 struct NegateOperator {
   template <class T> static bool CanNegate(T input) {
     using Limits = std::numeric_limits<T>;
@@ -69,6 +71,136 @@ template <> interval_t NegateOperator::Operation(interval_t input) {
   return result;
 }
 
+/**
+ * Non-throwing version of NegateOperator, records the error in error
+ */
+struct TryNegateOperator {
+  template <class TA, class TR>
+  static inline TR Operation(TA input, UDFErrorState &error) {
+    auto cast = (TR)input;
+    if (!NegateOperator::CanNegate<TR>(cast)) {
+      error.SetError("Overflow in negation of integer!",
+                     UDFErrorKind::OUT_OF_RANGE);
+      return TR();
+    }
+    return -cast;
+  }
+};
+
+template <>
+interval_t TryNegateOperator::Operation(interval_t input,
+                                        UDFErrorState &error) {
+  interval_t result;
+  result.months =
+      TryNegateOperator::Operation<int32_t, int32_t>(input.months, error);
+  result.days =
+      TryNegateOperator::Operation<int32_t, int32_t>(input.days, error);
+  result.micros =
+      TryNegateOperator::Operation<int64_t, int64_t>(input.micros, error);
+  return result;
+}
+
+template <class TA, class TB>
+std::string IntegerOverflowMessage(const char *operation, const char *symbol,
+                                   TA left, TB right) {
+  return StringUtil::Format("Overflow in %s of %s (%s %s %s)!", operation,
+                            TypeIdToString(GetTypeId<TA>()),
+                            NumericHelper::ToString(left), symbol,
+                            NumericHelper::ToString(right));
+}
+
+template <class TA, class TB>
+std::string DecimalOverflowMessage(const char *operation, const char *symbol,
+                                   const char *hint, TA left, TB right) {
+  auto leftText = Value::CreateValue(left).ToString();
+  auto rightText = Value::CreateValue(right).ToString();
+  if (std::is_same<TA, hugeint_t>::value) {
+    return StringUtil::Format("Overflow in %s of DECIMAL(38) (%s %s %s);",
+                              operation, leftText, symbol, rightText);
+  }
+  return StringUtil::Format(
+      "Overflow in %s of DECIMAL(18) (%s %s %s). You might want to add an "
+      "explicit cast to %s.",
+      operation, leftText, symbol, rightText, hint);
+}
+
+/**
+ * The message DuckDB's throwing overflow check raises for the Try operator OP
+ */
+template <class OP> struct OverflowMessage;
+
+template <> struct OverflowMessage<TryAddOperator> {
+  template <class TA, class TB> static std::string Get(TA left, TB right) {
+    return IntegerOverflowMessage("addition", "+", left, right);
+  }
+};
+
+template <> struct OverflowMessage<TrySubtractOperator> {
+  template <class TA, class TB> static std::string Get(TA left, TB right) {
+    return IntegerOverflowMessage("subtraction", "-", left, right);
+  }
+};
+
+template <> struct OverflowMessage<TryMultiplyOperator> {
+  template <class TA, class TB> static std::string Get(TA left, TB right) {
+    return IntegerOverflowMessage("multiplication", "*", left, right);
+  }
+};
+
+template <> struct OverflowMessage<TryDecimalAdd> {
+  template <class TA, class TB> static std::string Get(TA left, TB right) {
+    return DecimalOverflowMessage("addition", "+", "a bigger decimal", left,
+                                  right);
+  }
+};
+
+template <> struct OverflowMessage<TryDecimalSubtract> {
+  template <class TA, class TB> static std::string Get(TA left, TB right) {
+    return DecimalOverflowMessage("subtraction", "-", "a bigger decimal",
+                                  left, right);
+  }
+};
+
+template <> struct OverflowMessage<TryDecimalMultiply> {
+  template <class TA, class TB> static std::string Get(TA left, TB right) {
+    return DecimalOverflowMessage("multiplication", "*",
+                                  "a decimal with a smaller scale", left,
+                                  right);
+  }
+};
+
+/**
+ * Non-throwing version of the *OverflowCheck operators, OP is the matching
+ * Try operator that reports the overflow, records the error in error
+ */
+struct TryOverflowCheckWrapper {
+  template <class OP, class TA, class TB, class TR>
+  static inline TR Operation(TA left, TB right, UDFErrorState &error) {
+    TR result;
+    if (!OP::template Operation<TA, TB, TR>(left, right, result)) {
+      error.SetError(OverflowMessage<OP>::Get(left, right),
+                     UDFErrorKind::OUT_OF_RANGE);
+      return TR();
+    }
+    return result;
+  }
+};
+
+/**
+ * Fixed-point scale down of a decimal by factor (a power of ten), rounding
+ * half away from zero like DuckDB's decimal to decimal cast
+ */
+template <class SOURCE, class TARGET>
+inline TARGET DecimalScaleDown(SOURCE input, SOURCE factor) {
+  SOURCE scaled = input / (factor / SOURCE(2));
+  if (scaled < SOURCE(0)) {
+    scaled -= SOURCE(1);
+  } else {
+    scaled += SOURCE(1);
+  }
+  return Cast::Operation<SOURCE, TARGET>(scaled / SOURCE(2));
+}
+
 struct BinaryZeroIsNullWrapper {
   template <class OP, class LEFT_TYPE, class RIGHT_TYPE, class RESULT_TYPE>
   static inline RESULT_TYPE Operation(LEFT_TYPE left, RIGHT_TYPE right) {
@@ -80,3 +212,19 @@ struct BinaryZeroIsNullWrapper {
     }
   }
 };
+
+/**
+ * Non-throwing version of BinaryZeroIsNullWrapper, records the error in error
+ */
+struct TryBinaryZeroIsNullWrapper {
+  template <class OP, class LEFT_TYPE, class RIGHT_TYPE, class RESULT_TYPE>
+  static inline RESULT_TYPE Operation(LEFT_TYPE left, RIGHT_TYPE right,
+                                      UDFErrorState &error) {
+    if (right == 0) {
+      error.SetError("Division by zero");
+      return RESULT_TYPE();
+    }
+    return OP::template Operation<LEFT_TYPE, RIGHT_TYPE, RESULT_TYPE>(left,
+                                                                      right);
+  }
+};
@@ -49,6 +49,21 @@ struct ArrayLengthBinaryOperator {
   }
 };
 
+/**
+ * Non-throwing version of ArrayLengthBinaryOperator, records the error in error
+ */
+struct TryArrayLengthBinaryOperator {
+  template <class TA, class TB, class TR>
+  static inline TR Operation(TA input, TB dimension, UDFErrorState &error) {
+    if (dimension != 1) {
+      error.SetError("array_length for dimensions other than 1 not implemented",
+                     UDFErrorKind::NOT_IMPLEMENTED);
+      return TR();
+    }
+    return input.length;
+  }
+};
+
 // strlen returns the size in bytes
 struct StrLenOperator {
   template <class TA, class TR> static inline TR Operation(TA input) {
@@ -6,8 +6,39 @@
 #include "compiler_fmt/args.h"
 #include "compiler_fmt/core.h"
 #include "compiler_fmt/format.h"
+#include "duckdb/planner/expression/bound_cast_expression.hpp"
+#include "duckdb/planner/expression/bound_conjunction_expression.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "duckdb/planner/expression_iterator.hpp"
 #include <set>
 
+using duckdb::ExpressionClass;
+using duckdb::ExpressionType;
+
+static const duckdb::Expression &stripCasts(const duckdb::Expression &expr) {
+  if (expr.GetExpressionClass() == ExpressionClass::BOUND_CAST) {
+    return stripCasts(*expr.Cast<duckdb::BoundCastExpression>().child);
+  }
+  return expr;
+}
+
+static bool isVariable(const duckdb::Expression &expr, const Variable *var) {
+  auto &stripped = stripCasts(expr);
+  return (stripped.GetExpressionClass() == ExpressionClass::BOUND_COLUMN_REF ||
+          stripped.GetExpressionClass() == ExpressionClass::BOUND_REF) &&
+         toLower(stripped.GetName()) == toLower(var->getName());
+}
+
+static bool containsVariable(const duckdb::Expression &expr,
+                             const Variable *var) {
+  bool contains = isVariable(expr, var);
+  duckdb::ExpressionIterator::EnumerateChildren(
+      expr, [&](const duckdb::Expression &child) {
+        contains = contains || containsVariable(child, var);
+      });
+  return contains;
+}
+
 /**
  * find the column names in between the first select and from
  * split by comma
@@ -35,9 +66,158 @@ Vec<String> AggifyCodeGenerator::getOrginalCursorLoopCol(const json &ast) {
   return res;
 }
 
+/**
+ * var = var + e, LEAST(var, e), GREATEST(var, e), var AND e or var OR e where
+ * e does not read var
+ */
+Opt<AggifyCodeGenerator::Accumulator>
+AggifyCodeGenerator::getAccumulator(const duckdb::Expression &expr,
+                                    const Variable *var) const {
+  auto &stripped = stripCasts(expr);
+  auto &type = var->getType();
+  // exactly one operand is the variable itself
+  auto accumulates = [&](auto &children) {
+    std::size_t uses = 0;
+    for (auto &child : children) {
+      if (isVariable(*child, var)) {
+        ++uses;
+      } else if (containsVariable(*child, var)) {
+        return false;
+      }
+    }
+    return uses == 1;
+  };
+  if (stripped.GetExpressionClass() == ExpressionClass::BOUND_FUNCTION) {
+    auto &function = stripped.Cast<duckdb::BoundFunctionExpression>();
+    auto name = toLower(function.function.name);
+    if (function.children.size() != 2 || !accumulates(function.children)) {
+      return std::nullopt;
+    }
+    if (name == "+" && type.isNumeric() && !type.isBoolean()) {
+      return Accumulator::SUM;
+    } else if (name == "least") {
+      return Accumulator::MIN;
+    } else if (name == "greatest") {
+      return Accumulator::MAX;
+    }
+  } else if (stripped.GetExpressionClass() ==
+                 ExpressionClass::BOUND_CONJUNCTION &&
+             type.isBoolean()) {
+    auto &conjunction = stripped.Cast<duckdb::BoundConjunctionExpression>();
+    if (!accumulates(conjunction.children)) {
+      return std::nullopt;
+    }
+    return conjunction.GetExpressionType() == ExpressionType::CONJUNCTION_AND
+               ? Accumulator::AND
+               : Accumulator::OR;
+  }
+  return std::nullopt;
+}
+
+/**
+ * The update of every state variable, if each one is only changed by one
+ * kind of accumulation and no other code of the loop body reads it
+ */
+Opt<Map<const Variable *, AggifyCodeGenerator::Accumulator>>
+AggifyCodeGenerator::getAccumulators(
+    Function &f, const Vec<const Variable *> &stateVars) const {
+  Map<const Variable *, Accumulator> accumulators;
+  for (auto *var : stateVars) {
+    accumulators.insert({var, Accumulator::READ_ONLY});
+  }
+  Set<const Variable *> updated;
+  for (auto &block : f) {
+    for (auto &inst : block) {
+      auto *assign = dynamic_cast<const Assignment *>(&inst);
+      if (assign != nullptr && accumulators.count(assign->getLHS()) > 0) {
+        updated.insert(assign->getLHS());
+      }
+    }
+  }
+
+  for (auto &block : f) {
+    for (auto &inst : block) {
+      const Variable *accumulated = nullptr;
+      auto *assign = dynamic_cast<const Assignment *>(&inst);
+      if (assign != nullptr && updated.count(assign->getLHS()) > 0) {
+        auto *var = assign->getLHS();
+        auto accumulator = getAccumulator(
+            *assign->getRHS()->getLogicalPlan()->expressions[0], var);
+        if (!accumulator || (accumulators.at(var) != Accumulator::READ_ONLY &&
+                             accumulators.at(var) != *accumulator)) {
+          return std::nullopt;
+        }
+        accumulators[var] = *accumulator;
+        accumulated = var;
+      }
+      for (auto *var : inst.getOperands()) {
+        if (updated.count(var) > 0 && var != accumulated) {
+          return std::nullopt;
+        }
+      }
+    }
+  }
+  return accumulators;
+}
+
+/**
+ * Merges the state of another thread into the target, a SUM adds what the
+ * other thread accumulated on top of the shared initial value
+ */
+String AggifyCodeGenerator::getCombine(
+    const Map<const Variable *, Accumulator> &accumulators,
+    const Vec<const Variable *> &stateVars) const {
+  String copyState, combineBody;
+  for (auto *var : stateVars) {
+    auto name = var->getName();
+    auto accumulator = accumulators.at(var);
+    copyState += fmt::format(fmt::runtime(config.aggify["copyState"].Scalar()),
+                             fmt::arg("name", name));
+    if (accumulator == Accumulator::SUM) {
+      copyState +=
+          fmt::format(fmt::runtime(config.aggify["copyState"].Scalar()),
+                      fmt::arg("name", name + "_init"));
+    }
+
+    String combineTemplate;
+    switch (accumulator) {
+    case Accumulator::READ_ONLY:
+      continue;
+    case Accumulator::SUM:
+      combineTemplate = "sumCombine";
+      break;
+    case Accumulator::MIN:
+      combineTemplate = "minCombine";
+      break;
+    case Accumulator::MAX:
+      combineTemplate = "maxCombine";
+      break;
+    case Accumulator::AND:
+      combineTemplate = "andCombine";
+      break;
+    case Accumulator::OR:
+      combineTemplate = "orCombine";
+      break;
+    }
+    // floating point sums saturate instead of overflowing
+    auto tag = var->getType().getDuckDBTag();
+    bool floatingPoint =
+        tag == DuckdbTypeTag::DOUBLE || tag == DuckdbTypeTag::REAL;
+    combineBody += fmt::format(
+        fmt::runtime(config.aggify[combineTemplate].Scalar()),
+        fmt::arg("name", name), fmt::arg("type", var->getType().getCppType()),
+        fmt::arg("operatorSuffix",
+                 floatingPoint ? "Operator" : "OperatorOverflowCheck"));
+  }
+  return fmt::format(fmt::runtime(config.aggify["combineOperation"].Scalar()),
+                     fmt::arg("copyState", copyState),
+                     fmt::arg("combineBody", combineBody));
+}
+
 AggifyCodeGeneratorResult AggifyCodeGenerator::run(
     Function &f, const json &ast, Vec<const Variable *> cursorVars,
-    Vec<const Variable *> usedVars, const Variable *retVariable, size_t id) {
+    Vec<const Variable *> usedVars, const Variable *retVariable, size_t id,
+    bool earlyExit) {
 
   String name = f.getFunctionName();
   String code;
@@ -49,6 +229,18 @@ AggifyCodeGeneratorResult AggifyCodeGenerator::run(
   String inputTypes, inputLogicalTypes;
   size_t count = 0;
 
+  // the state variables are the ones reused across iterations
+  Vec<const Variable *> stateVars;
+  for (auto *usedVar : usedVars) {
+    if (std::find(cursorVars.begin(), cursorVars.end(), usedVar) ==
+        cursorVars.end()) {
+      stateVars.push_back(usedVar);
+    }
+  }
+  // which rows come before an EXIT depends on their order
+  auto accumulators =
+      earlyExit ? std::nullopt : getAccumulators(f, stateVars);
+
   for (auto *usedVar : usedVars) {
     // all the c(s) in the template file
 
@@ -66,6 +258,18 @@ AggifyCodeGeneratorResult AggifyCodeGenerator::run(
                              fmt::arg("name", usedVar->getName()),
                              fmt::arg("i", count));
 
+      // a sum remembers its initial value, which every thread starts from
+      if (accumulators && accumulators->at(usedVar) == Accumulator::SUM) {
+        stateDefinition += fmt::format(
+            fmt::runtime(config.aggify["stateDefinition"].Scalar()),
+            fmt::arg("type", usedVar->getType().getCppType()),
+            fmt::arg("name", usedVar->getName() + "_init"));
+        varInit +=
+            fmt::format(fmt::runtime(config.aggify["sumInit"].Scalar()),
+                        fmt::arg("name", usedVar->getName()),
+                        fmt::arg("i", count));
+      }
+
       argInit += fmt::format(fmt::runtime(config.aggify["argInit"].Scalar()),
                              fmt::arg("name", usedVar->getName()));
 
@@ -133,6 +337,13 @@ AggifyCodeGeneratorResult AggifyCodeGenerator::run(
       container.basicBlockCodes.push_back(blockCode);
       continue;
     }
+    if (bbUniq.getLabel() == "accumulateExitBlock") {
+      String blockCode = fmt::format(
+          "accumulateExitBlock:\n{{{}\nstate.isDone = true;\nreturn;}}",
+          argStore);
+      container.basicBlockCodes.push_back(blockCode);
+      continue;
+    }
     basicBlockCodeGenerator(&bbUniq, f, function_info);
   }
 
@@ -160,7 +371,12 @@ AggifyCodeGeneratorResult AggifyCodeGenerator::run(
     String c = "c" + std::to_string(i + 1);
     store.push_back(fmt::arg(c.c_str(), inputDependentComps[i]));
   }
+  store.push_back(fmt::arg("dataChunkInit", dataChunkInit));
   store.push_back(fmt::arg("optionalChunkReset", optionalChunkReset));
+  // without a combine callback DuckDB can't merge thread-local states
+  store.push_back(fmt::arg(
+      "combine", accumulators ? "AggregateFunction::StateCombine<STATE, OP>"
+                              : "nullptr"));
 
   code = fmt::vformat(fmt::runtime(varyingFuncTemplate).str, store);
 
@@ -170,12 +386,13 @@ AggifyCodeGeneratorResult AggifyCodeGenerator::run(
       fmt::arg("stateDefinition", stateDefinition),
       fmt::arg("createValue", createValue),
       fmt::arg("optionalDataChunk", optionalDataChunk),
-      fmt::arg("dataChunkInit", dataChunkInit),
       fmt::arg("destroyValue", destroyValue), fmt::arg("argInit", argInit),
       fmt::arg("tmpVecInit", tmpVecInit),
       fmt::arg("operationArgs", operationArgs),
       fmt::arg("operationNullArgs", operationNullArgs),
       fmt::arg("varInit", varInit), fmt::arg("body", body),
+      fmt::arg("combineOperation",
+               accumulators ? getCombine(*accumulators, stateVars) : ""),
       fmt::arg("returnVariable", retVariable->getName()));
 
   String registration = fmt::format(
@@ -184,7 +401,9 @@ AggifyCodeGeneratorResult AggifyCodeGenerator::run(
       fmt::arg("outputType", f.getReturnType().getCppType()),
       fmt::arg("inputLogicalTypes", inputLogicalTypes),
       fmt::arg("outputLogicalType",
-               f.getReturnType().getDuckDBLogicalTypeStr()));
+               f.getReturnType().getDuckDBLogicalTypeStr()),
+      fmt::arg("orderDependence",
+               accumulators ? "NOT_ORDER_DEPENDENT" : "ORDER_DEPENDENT"));
 
-  return {{code, registration}, name};
+  return {{code, registration}, name, !accumulators.has_value()};
 }
@@ -3,6 +3,14 @@
 #include "cfg_code_generator.hpp"
 #include "compiler.hpp"
 #include "dead_code_elimination.hpp"
+#include "duckdb/parser/expression/columnref_expression.hpp"
+#include "duckdb/parser/expression/comparison_expression.hpp"
+#include "duckdb/parser/expression/conjunction_expression.hpp"
+#include "duckdb/parser/expression/constant_expression.hpp"
+#include "duckdb/parser/parser.hpp"
+#include "duckdb/parser/query_node/select_node.hpp"
+#include "duckdb/parser/result_modifier.hpp"
+#include "duckdb/parser/statement/select_statement.hpp"
 #include "file.hpp"
 #include "instructions.hpp"
 #include "liveness_analysis.hpp"
@@ -47,8 +55,10 @@ static bool allBlocksNaive(const Vec<BasicBlock *> &basicBlocks) {
   return true;
 }
 
-// only one block has outgoing branch
-static bool supportedCursorLoop(const Vec<BasicBlock *> &basicBlocks) {
+// all outgoing branches (the loop exit and any allowed EXIT) go to the same
+// block
+static bool supportedCursorLoop(const Vec<BasicBlock *> &basicBlocks,
+                                bool allowExit) {
   Set<BasicBlock *> blockSet;
   for (auto *block : basicBlocks) {
     blockSet.insert(block);
@@ -59,18 +69,210 @@ static bool supportedCursorLoop(const Vec<BasicBlock *> &basicBlocks) {
   //   return false;
   // }
 
-  bool outgoing = false;
+  BasicBlock *outgoing = nullptr;
   for (auto *block : basicBlocks) {
+    // a RETURN would need a second result besides the aggregate
+    if (dynamic_cast<const ReturnInst *>(block->getTerminator()) != nullptr) {
+      return false;
+    }
     for (auto *succ : block->getSuccessors()) {
       if (blockSet.count(succ) == 0) {
-        if (outgoing) {
+        if (outgoing != nullptr && (!allowExit || outgoing != succ)) {
           return false;
         }
-        outgoing = true;
+        outgoing = succ;
+      }
+    }
+  }
+  return outgoing != nullptr;
+}
+
+/**
+ * The fetch query without its equality predicates on variables of the function
+ * (the correlation), which select the join keys instead
+ */
+struct Decorrelation {
+  String query;
+  Vec<String> keys;
+  Vec<String> correlations;
+};
+
+/**
+ * The fetch query as a single SELECT without CTEs, or nullptr
+ */
+static duckdb::unique_ptr<duckdb::SQLStatement>
+parseFetchQuery(const String &fetchQuery) {
+  duckdb::Parser parser;
+  try {
+    parser.ParseQuery(fetchQuery);
+  } catch (const std::exception &) {
+    return nullptr;
+  }
+  if (parser.statements.size() != 1 ||
+      parser.statements[0]->type != duckdb::StatementType::SELECT_STATEMENT) {
+    return nullptr;
+  }
+  auto &node = parser.statements[0]->Cast<duckdb::SelectStatement>().node;
+  if (node->type != duckdb::QueryNodeType::SELECT_NODE ||
+      !node->cte_map.map.empty()) {
+    return nullptr;
+  }
+  return std::move(parser.statements[0]);
+}
+
+static Opt<Decorrelation> decorrelateFetchQuery(const String &fetchQuery,
+                                                Function &f) {
+  using duckdb::ExpressionClass;
+  using duckdb::ExpressionType;
+  using duckdb::ParsedExpression;
+
+  auto statement = parseFetchQuery(fetchQuery);
+  if (statement == nullptr) {
+    return std::nullopt;
+  }
+  auto &node = statement->Cast<duckdb::SelectStatement>()
+                   .node->Cast<duckdb::SelectNode>();
+  if (!node.modifiers.empty()) {
+    return std::nullopt;
+  }
+  // adding the keys to a grouped or aggregated select list changes its rows
+  if (!node.groups.group_expressions.empty() || node.having || node.qualify ||
+      node.where_clause == nullptr) {
+    return std::nullopt;
+  }
+  for (auto &expr : node.select_list) {
+    if (expr->GetExpressionClass() != ExpressionClass::COLUMN_REF &&
+        expr->GetExpressionClass() != ExpressionClass::STAR) {
+      return std::nullopt;
+    }
+  }
+
+  auto getVariable = [&](const ParsedExpression &expr) -> const Variable * {
+    if (expr.GetExpressionClass() != ExpressionClass::COLUMN_REF) {
+      return nullptr;
+    }
+    auto &columnRef = expr.Cast<duckdb::ColumnRefExpression>();
+    auto name = toLower(columnRef.GetColumnName());
+    if (columnRef.IsQualified() || !f.hasBinding(name)) {
+      return nullptr;
+    }
+    return f.getBinding(name);
+  };
+
+  // split the WHERE clause into the correlated equalities and the rest
+  Decorrelation result;
+  duckdb::vector<duckdb::unique_ptr<ParsedExpression>> remaining;
+  std::function<void(duckdb::unique_ptr<ParsedExpression>)> split =
+      [&](duckdb::unique_ptr<ParsedExpression> expr) {
+        if (expr->GetExpressionType() == ExpressionType::CONJUNCTION_AND) {
+          for (auto &child :
+               expr->Cast<duckdb::ConjunctionExpression>().children) {
+            split(std::move(child));
+          }
+          return;
+        }
+        if (expr->GetExpressionType() == ExpressionType::COMPARE_EQUAL) {
+          auto &comparison = expr->Cast<duckdb::ComparisonExpression>();
+          auto *leftVar = getVariable(*comparison.left);
+          auto *rightVar = getVariable(*comparison.right);
+          auto &key = leftVar == nullptr ? comparison.left : comparison.right;
+          auto *var = leftVar == nullptr ? rightVar : leftVar;
+          if ((leftVar == nullptr) != (rightVar == nullptr) &&
+              key->GetExpressionClass() == ExpressionClass::COLUMN_REF) {
+            auto name = fmt::format("aggify_key{}", result.keys.size());
+            result.correlations.push_back(
+                fmt::format("{} = {}", name, var->getName()));
+            result.keys.push_back(name);
+            key->alias = name;
+            node.select_list.push_back(std::move(key));
+            return;
+          }
+        }
+        remaining.push_back(std::move(expr));
+      };
+  split(std::move(node.where_clause));
+  if (result.keys.empty()) {
+    return std::nullopt;
+  }
+  if (remaining.size() == 1) {
+    node.where_clause = std::move(remaining[0]);
+  } else if (remaining.size() > 1) {
+    node.where_clause = duckdb::make_uniq<duckdb::ConjunctionExpression>(
+        ExpressionType::CONJUNCTION_AND, std::move(remaining));
+  }
+  result.query = node.ToString();
+
+  // the rest of the query must not depend on the calling row
+  Vec<const Variable *> variables;
+  for (auto &arg : f.getArguments()) {
+    variables.push_back(arg.get());
+  }
+  for (auto &var : f.getVariables()) {
+    variables.push_back(var.get());
+  }
+  for (auto *var : variables) {
+    std::regex varRegex("\\b" + var->getName() + "\\b", std::regex::icase);
+    if (std::regex_search(result.query, varRegex)) {
+      return std::nullopt;
+    }
+  }
+  return result;
+}
+
+Opt<OrderedFetch> AggifyPass::orderFetchQuery(const String &fetchQuery,
+                                              std::size_t fieldCount) {
+  using duckdb::ExpressionClass;
+
+  auto statement = parseFetchQuery(fetchQuery);
+  if (statement == nullptr) {
+    return std::nullopt;
+  }
+  auto &node = statement->Cast<duckdb::SelectStatement>()
+                   .node->Cast<duckdb::SelectNode>();
+  duckdb::OrderModifier *orderModifier = nullptr;
+  bool distinct = false;
+  for (auto &modifier : node.modifiers) {
+    if (modifier->type == duckdb::ResultModifierType::DISTINCT_MODIFIER) {
+      distinct = true;
+    } else if (modifier->type == duckdb::ResultModifierType::ORDER_MODIFIER) {
+      orderModifier = &modifier->Cast<duckdb::OrderModifier>();
+    }
+  }
+  if (orderModifier == nullptr) {
+    return OrderedFetch{fetchQuery, ""};
+  }
+  // extra columns would change the rows of a DISTINCT or a grouping
+  if (distinct || !node.groups.group_expressions.empty() ||
+      node.aggregate_handling != duckdb::AggregateHandling::STANDARD_HANDLING) {
+    return std::nullopt;
+  }
+
+  Vec<String> orders;
+  for (auto &order : orderModifier->orders) {
+    String key;
+    auto &expr = *order.expression;
+    if (expr.GetExpressionClass() == ExpressionClass::CONSTANT) {
+      // ORDER BY <position> refers to a column of the select list
+      auto &value = expr.Cast<duckdb::ConstantExpression>().value;
+      if (!value.type().IsIntegral() || value.IsNull() ||
+          value.GetValue<int64_t>() < 1 ||
+          value.GetValue<int64_t>() > (int64_t)fieldCount) {
+        return std::nullopt;
       }
+      key = fmt::format("fetchQueryVar{}", value.GetValue<int64_t>() - 1);
+    } else {
+      key = fmt::format("aggify_order{}", orders.size());
+      auto column = expr.Copy();
+      column->alias = key;
+      node.select_list.push_back(std::move(column));
     }
+    duckdb::OrderByNode orderNode(
+        order.type, order.null_order,
+        duckdb::make_uniq<duckdb::ColumnRefExpression>(key));
+    orders.push_back(orderNode.ToString());
   }
-  return outgoing;
+  return OrderedFetch{node.ToString(),
+                      " ORDER BY " + joinVector(orders, ", ")};
 }
 
 /**
@@ -159,9 +361,24 @@ String AggifyPass::outlineCursorLoop(Function &newFunction,
   // make this a dummy block
   auto returnBlock =
       cursorLoopBodyFunction->makeBasicBlock("accumulateReturnBlock");
-  auto loopHeader = getNextBasicBlock(loopBodyBlocks);
-  ASSERT(loopHeader.size() == 1, "Expected exactly one loop header");
-  cursorLoopBodyFunction->renameBasicBlocks(*loopHeader.begin(), returnBlock);
+  // an EXIT branches to the block after the loop instead of the header, it
+  // marks the state as done so that the remaining rows are skipped
+  auto *loopExit = newFunction.getBlockFromLabel("returnBlock");
+  bool earlyExit = false;
+  bool firstRowOnly = true;
+  auto nextBlocks = getNextBasicBlock(loopBodyBlocks);
+  ASSERT(nextBlocks.size() <= 2, "Expected the loop header and loop exit");
+  for (auto *nextBlock : nextBlocks) {
+    if (nextBlock == loopExit) {
+      earlyExit = true;
+      cursorLoopBodyFunction->renameBasicBlocks(
+          nextBlock,
+          cursorLoopBodyFunction->makeBasicBlock("accumulateExitBlock"));
+    } else {
+      firstRowOnly = false;
+      cursorLoopBodyFunction->renameBasicBlocks(nextBlock, returnBlock);
+    }
+  }
 
   // From Aggify: all variables referenced in the loop body Δ
   Vec<const Variable *> loopBodyUsedVars;
@@ -237,7 +454,7 @@ String AggifyPass::outlineCursorLoop(Function &newFunction,
       *cursorLoopBodyFunction, cursorLoopInfo, cursorVars, loopBodyUsedVars,
       cursorLoopBodyFunction->getBinding(
           oldFunction.getOriginalName(returnVariable->getName())),
-      outlinedCount);
+      outlinedCount, earlyExit);
 
   insertDefAndReg(res.code, res.registration, compiler.getUdfCount());
   // compile the template
@@ -267,6 +484,7 @@ String AggifyPass::outlineCursorLoop(Function &newFunction,
   // the initial values of the arguments to the custom aggregate
   Vec<String> customAggCallerArgs;
   String returnVariableInitValue;
+  bool correlatedArgs = false;
   for (auto *var : loopBodyUsedVars) {
     if (cursorVarToFetchQueryVarName.find(var) !=
         cursorVarToFetchQueryVarName.end()) {
@@ -287,6 +505,8 @@ String AggifyPass::outlineCursorLoop(Function &newFunction,
             oldFunction.renameVarInExpression(tmpInitExpr.get(), newToOld);
       }
       customAggCallerArgs.push_back(initialization->getRawSQL());
+      correlatedArgs =
+          correlatedArgs || !initialization->getUsedVariables().empty();
 
       // a return variable will always be used so there must be an
       // initialization
@@ -307,14 +527,55 @@ String AggifyPass::outlineCursorLoop(Function &newFunction,
     fetchQueryVarNames.push_back("fetchQueryVar" + std::to_string(varId));
     varId++;
   }
+
+  // a fetch query parameterized by the arguments is aggregated once per key
+  // and joined back, instead of once per calling row
+  if (duckdb::optimizerPassOnMap.at("AggifyDecorrelation") == true &&
+      !correlatedArgs && !firstRowOnly) {
+    if (auto decorrelation = decorrelateFetchQuery(fetchQuery, oldFunction)) {
+      String cursorQuery = fmt::format(
+          "SELECT * FROM ({}) fetchQueryTmpTable({})", decorrelation->query,
+          joinVector(fetchQueryVarNames, ", "));
+      compiler.getUdfCount()++;
+      return fmt::format(
+          fmt::runtime(
+              compiler.getConfig().aggify["decorrelatedCaller"].Scalar()),
+          fmt::arg("customAggName", res.name),
+          fmt::arg("funcArgs", joinVector(customAggCallerArgs, ", ")),
+          fmt::arg("returnVarName", returnVariableInitValue),
+          fmt::arg("cursorQuery", cursorQuery),
+          fmt::arg("keys", joinVector(decorrelation->keys, ", ")),
+          fmt::arg("correlation",
+                   joinVector(decorrelation->correlations, " AND ")));
+    }
+  }
+
+  // DuckDB does not keep the order of the fetch query in a parallel plan, so
+  // a loop that depends on it becomes an ordered aggregate
+  String orderBy;
+  if (res.orderDependent &&
+      duckdb::optimizerPassOnMap.at("OrderedAggify") == true) {
+    if (auto orderedFetch =
+            orderFetchQuery(fetchQuery, fetchQueryVarNames.size())) {
+      fetchQuery = orderedFetch->query;
+      orderBy = orderedFetch->orderBy;
+    }
+  }
+
   String cursorQuery =
       fmt::format("SELECT * FROM ({}) fetchQueryTmpTable({})", fetchQuery,
                   joinVector(fetchQueryVarNames, ", "));
+  // a body that always EXITs only sees the first row, so the scan can stop
+  // there
+  if (firstRowOnly) {
+    cursorQuery += " LIMIT 1";
+  }
 
   String customAggCaller =
       fmt::format(fmt::runtime(compiler.getConfig().aggify["caller"].Scalar()),
                   fmt::arg("customAggName", res.name),
                   fmt::arg("funcArgs", joinVector(customAggCallerArgs, ", ")),
+                  fmt::arg("orderBy", orderBy),
                   fmt::arg("returnVarName", returnVariableInitValue),
                   fmt::arg("cursorQuery", cursorQuery));
 
@@ -330,7 +591,9 @@ bool AggifyPass::outlineRegion(const Region *region, Function &f) {
     return false;
   }
 
-  if (!supportedCursorLoop(blocksToOutline)) {
+  if (!supportedCursorLoop(
+          blocksToOutline,
+          duckdb::optimizerPassOnMap.at("AggifyEarlyExit") == true)) {
     INFO("Aggify only supports cursor loops without break or return.");
     return false;
   }
@@ -383,12 +646,27 @@ bool AggifyPass::outlineRegion(const Region *region, Function &f) {
     }
   }
 
-  ASSERT(returnVars.size() == 1,
-         fmt::format("Do not support one cursor loop to return {} variables",
+  // the custom aggregate finalizes into a single typed result, so a loop
+  // with several live-out variables is left to the outlining pass
+  if (returnVars.size() != 1) {
+    INFO(fmt::format("Do not support one cursor loop to return {} variables",
                      returnVars.size()));
+    return false;
+  }
 
   auto *returnVariable = *returnVars.begin();
 
+  // with an EXIT the block after the loop merges the return variable, any
+  // other phi is dead and would be left without a definition
+  for (auto &inst : *nextBasicBlock) {
+    if (auto *phi = dynamic_cast<const PhiNode *>(&inst)) {
+      if (phi->getLHS() != returnVariable) {
+        INFO("Aggify does not support dead phis after the cursor loop");
+        return false;
+      }
+    }
+  }
+
   String newFunctionName =
       fmt::format("{}_aggify_{}", f.getFunctionName(), outlinedCount);
   Vec<const Variable *> newFunctionArgs;
@@ -435,10 +713,36 @@ bool AggifyPass::outlineRegion(const Region *region, Function &f) {
   }
   ASSERT(loopBodyRegion != nullptr, "Could not find loop body region!");
 
+  // only the variables read or written by the loop body become part of the
+  // aggregate, values that are merely live through the loop are not passed
+  Set<String> loopBodyVars = {
+      Function::getOriginalName(returnVariable->getName())};
+  for (auto *block : loopBodyRegion->getBasicBlocks()) {
+    for (auto &inst : *block) {
+      for (auto *var : inst.getOperands()) {
+        loopBodyVars.insert(Function::getOriginalName(var->getName()));
+      }
+      if (auto *var = inst.getResultOperand()) {
+        loopBodyVars.insert(Function::getOriginalName(var->getName()));
+      }
+    }
+  }
   Vec<const Variable *> customAggArgs;
   auto loopBodyLiveIn = liveness->getBlockLiveIn(loopBodyRegion->getHeader());
   for (auto *var : loopBodyLiveIn) {
-    customAggArgs.push_back(var);
+    if (loopBodyVars.count(Function::getOriginalName(var->getName())) > 0) {
+      customAggArgs.push_back(var);
+    }
+  }
+  // a return variable that is only written before an EXIT is not live into
+  // the loop body but still has to be part of the state
+  if (std::none_of(customAggArgs.begin(), customAggArgs.end(),
+                   [&](const Variable *var) {
+                     return Function::getOriginalName(var->getName()) ==
+                            Function::getOriginalName(
+                                returnVariable->getName());
+                   })) {
+    customAggArgs.push_back(returnVariable);
   }
   std::sort(customAggArgs.begin(), customAggArgs.end(),
             [](const Variable *v1, const Variable *v2) {
@@ -449,14 +753,23 @@ bool AggifyPass::outlineRegion(const Region *region, Function &f) {
       outlineCursorLoop(*newFunction, loopBodyBlocks, f, newFunctionArgs,
                         customAggArgs, returnVariable, region->getMetadata());
 
+  ASSERT(nextBasicBlock != nullptr, "NextBasicBlock cannot be nullptr!!");
+  // the aggregate now defines what the phi merged
+  for (auto it = nextBasicBlock->begin(); it != nextBasicBlock->end();) {
+    if (dynamic_cast<const PhiNode *>(&*it) != nullptr) {
+      it = nextBasicBlock->removeInst(it);
+    } else {
+      ++it;
+    }
+  }
   auto assign = Make<Assignment>(returnVariable,
                                  f.bindExpression(customAggCaller, returnType));
-  ASSERT(nextBasicBlock != nullptr, "NextBasicBlock cannot be nullptr!!");
   nextBasicBlock->insertBefore(nextBasicBlock->begin(), std::move(assign));
 
   auto &loopHeaderPreds = loopHeader->getPredecessors();
-  ASSERT(loopHeaderPreds.size() >= 2,
-         "Must have at least two predecessor for region!");
+  // a body that always EXITs never branches back to the header
+  ASSERT(loopHeaderPreds.size() >= 1,
+         "Must have at least one predecessor for region!");
   BasicBlock *pred = nullptr;
   for (auto *p : loopHeaderPreds) {
     if (blocksToOutlineSet.find(p) == blocksToOutlineSet.end()) {
@@ -466,13 +779,17 @@ bool AggifyPass::outlineRegion(const Region *region, Function &f) {
     }
   }
 
-  // predercessor of next basic block in the loop
+  // predercessor of next basic block in the loop, the ones of an EXIT are
+  // dropped along with the loop
   BasicBlock *nextPred = nullptr;
-  for (auto *p : nextBasicBlock->getPredecessors()) {
+  auto nextPreds = nextBasicBlock->getPredecessors();
+  for (auto *p : nextPreds) {
     if (blocksToOutlineSet.find(p) != blocksToOutlineSet.end()) {
-      ASSERT(nextPred == nullptr,
-             "Found more than one pred that is not in the region");
-      nextPred = p;
+      if (nextPred == nullptr) {
+        nextPred = p;
+      } else {
+        nextBasicBlock->removePredecessor(p);
+      }
     }
   }
 
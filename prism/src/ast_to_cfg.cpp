@@ -489,13 +489,9 @@ Own<Region> AstToCFG::constructCursorLoopCFG(const json &cursorLoopJson,
 
   String fetchQuery =
       cursorLoopJson["query"]["PLpgSQL_expr"]["query"].get<String>();
-  String commentedFetchQuery =
-      "/*fetchQueryStart*/" + fetchQuery + "/*fetchQueryEnd*/";
   // create a block for the condition
-  String cursorLoopWhileQuery =
-      fmt::format("select ANY_VALUE(cursorloopiter) < count(*) from tmp, {} "
-                  "cursorloopEmptyTmp",
-                  commentedFetchQuery);
+  String cursorLoopWhileQuery = fmt::format(
+      fmt::runtime(CURSOR_LOOP_CONDITION), fmt::arg("fetchQuery", fetchQuery));
   auto condExpr = f.bindExpression(cursorLoopWhileQuery, Type::BOOLEAN, true);
 
   auto incrementBlock = f.makeBasicBlock();
@@ -523,16 +519,17 @@ Own<Region> AstToCFG::constructCursorLoopCFG(const json &cursorLoopJson,
     varId++;
   }
 
-  String fetchVarQuery = fmt::format(
-      "SELECT {{}} FROM ({}) fetchQueryTmpTable({}) WHERE cursorloopiter::BOOL",
-      fetchQuery, joinVector(varsInFetchQuery, ", "));
   varId = 0;
   for (auto &var : varsInCursorLoop) {
+    String fetchVarQuery = fmt::format(
+        fmt::runtime(CURSOR_LOOP_FIELD),
+        fmt::arg("field", varsInFetchQuery[varId]),
+        fmt::arg("fetchQuery", fetchQuery),
+        fmt::arg("columns", joinVector(varsInFetchQuery, ", ")));
     loopVarBlock->addInstruction(Make<Assignment>(
         f.getBinding(var),
-        f.bindExpression(
-            fmt::format(fmt::runtime(fetchVarQuery), varsInFetchQuery[varId]),
-            f.getBinding(var)->getType(), true, false)));
+        f.bindExpression(fetchVarQuery, f.getBinding(var)->getType(), true,
+                         false)));
     varId++;
   }
   loopVarBlock->addInstruction(Make<BranchInst>(incrementBlock));
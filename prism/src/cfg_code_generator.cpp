@@ -6,6 +6,7 @@
 #include "cfg_code_generator.hpp"
 #include "logical_operator_code_generator.hpp"
 #include "types.hpp"
+#include "udf_transpiler_extension.hpp"
 
 String CFGCodeGenerator::createReturnValue(const String &retName,
                                            const Type &retType,
@@ -29,17 +30,35 @@ String CFGCodeGenerator::createReturnValue(const String &retName,
   }
 }
 
+/**
+ * a STRUCT result packs the variables named by its fields
+ * (outlined regions with several live-out variables)
+ */
+String CFGCodeGenerator::createStructReturnValue(const String &retName,
+                                                 const Type &retType) {
+  String code = "child_list_t<Value> struct_values;\n";
+  for (auto &[name, fieldType] : retType.getFields()) {
+    code += fmt::format("{{\nValue field_value;\n{};\n"
+                        "struct_values.emplace_back(\"{}\", "
+                        "std::move(field_value));\n}}\n",
+                        createReturnValue("field_value", fieldType, name),
+                        name);
+  }
+  return code + fmt::format("{} = Value::STRUCT(std::move(struct_values))",
+                            retName);
+}
+
 /**
  * for each instruction in the basic block, generate the corresponding C++ code
+ * a conditional branch only generates its condition, which is stored in cond
  */
-void CFGCodeGenerator::basicBlockCodeGenerator(BasicBlock *bb,
-                                               const Function &f,
-                                               CodeGenInfo &function_info) {
+String CFGCodeGenerator::instructionCodeGenerator(BasicBlock *bb,
+                                                  const Function &f,
+                                                  CodeGenInfo &function_info,
+                                                  String &cond) {
   String code;
-  code += fmt::format("/* ==== Basic block {} start ==== */\n", bb->getLabel());
-  code += fmt::format("{}:\n{{\n", bb->getLabel());
-
   for (auto &inst : *bb) {
+    function_info.mayFail = false;
     try {
       if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
         if (assign->getRHS()->isSQLExpression()) {
@@ -51,6 +70,13 @@ void CFGCodeGenerator::basicBlockCodeGenerator(BasicBlock *bb,
         auto [header, res] = locg.getResult();
         code += header;
         code += fmt::format("{} = {};\n", assign->getLHS()->getName(), res);
+        code += errorCheckCodeGenerator(function_info);
+      } else if (dynamic_cast<const ReturnInst *>(&inst) &&
+                 f.getReturnType().isStruct()) {
+        code += fmt::format(
+            "{};\nreturn;\n",
+            createStructReturnValue(config.function["return_name"].Scalar(),
+                                    f.getReturnType()));
       } else if (auto *ret = dynamic_cast<const ReturnInst *>(&inst)) {
         duckdb::LogicalOperatorCodeGenerator locg;
         auto *plan = ret->getExpr()->getLogicalPlan();
@@ -68,11 +94,8 @@ void CFGCodeGenerator::basicBlockCodeGenerator(BasicBlock *bb,
           locg.VisitOperator(*plan, function_info);
           auto [header, res] = locg.getResult();
           code += header;
-          code += fmt::format("if({}) goto {};\n", res,
-                              br->getIfTrue()->getLabel());
-          code += fmt::format("goto {};\n", br->getIfFalse()->getLabel());
-        } else {
-          code += fmt::format("goto {};\n", br->getIfTrue()->getLabel());
+          code += errorCheckCodeGenerator(function_info);
+          cond = res;
         }
       } else if (dynamic_cast<const PhiNode *>(&inst)) {
         ERROR("Encountered a phi instruction which should have been removed "
@@ -94,11 +117,229 @@ void CFGCodeGenerator::basicBlockCodeGenerator(BasicBlock *bb,
       throw duckdb::ParserException(ss.str());
     }
   }
+  return code;
+}
+
+/**
+ * in exception-free mode, leave the body as soon as the instruction just
+ * generated has recorded an error
+ */
+String CFGCodeGenerator::errorCheckCodeGenerator(CodeGenInfo &function_info) {
+  if (!function_info.mayFail) {
+    return "";
+  }
+  errorStateUsed = true;
+  return config.function["error_check"].Scalar() + "\n";
+}
+
+/**
+ * generate the C++ code of a basic block with every edge as a goto
+ */
+void CFGCodeGenerator::basicBlockCodeGenerator(BasicBlock *bb,
+                                               const Function &f,
+                                               CodeGenInfo &function_info) {
+  String code, cond;
+  code += fmt::format("/* ==== Basic block {} start ==== */\n", bb->getLabel());
+  code += fmt::format("{}:\n{{\n", bb->getLabel());
+  code += instructionCodeGenerator(bb, f, function_info, cond);
+
+  if (auto *br = dynamic_cast<const BranchInst *>(bb->getTerminator())) {
+    if (br->isConditional()) {
+      code += fmt::format("if({}) goto {};\n", cond,
+                          br->getIfTrue()->getLabel());
+      code += fmt::format("goto {};\n", br->getIfFalse()->getLabel());
+    } else {
+      code += fmt::format("goto {};\n", br->getIfTrue()->getLabel());
+    }
+  }
   code += "}\n";
   container.basicBlockCodes.push_back(code);
   return;
 }
 
+/**
+ * structured code can only be generated if the region tree covers every basic
+ * block of the function exactly once
+ */
+bool CFGCodeGenerator::canGenerateStructured(const Function &f) const {
+  if (f.getRegion() == nullptr) {
+    return false;
+  }
+  Set<const BasicBlock *> blocks;
+  for (auto *block : f.getRegion()->getBasicBlocks()) {
+    if (!blocks.insert(block).second) {
+      return false;
+    }
+  }
+  std::size_t blockCount = 0;
+  for (auto &block : f) {
+    if (blocks.count(&block) == 0) {
+      return false;
+    }
+    ++blockCount;
+  }
+  return blockCount == blocks.size();
+}
+
+/**
+ * the C++ code for jumping to target when next is the block that is reached by
+ * falling out of the code currently being emitted
+ */
+String
+CFGCodeGenerator::jumpCodeGenerator(const BasicBlock *target,
+                                    const BasicBlock *next,
+                                    const Vec<LoopContext> &loops) const {
+  if (target == next) {
+    return "";
+  }
+  if (!loops.empty()) {
+    if (target == loops.back().header) {
+      return "continue;\n";
+    }
+    if (target == loops.back().exit) {
+      return "break;\n";
+    }
+  }
+  // the edge is not expressible in the region tree, keep it as a goto
+  return fmt::format("goto {};\n", target->getLabel());
+}
+
+/**
+ * recursively generate structured C++ code (if/else and loops) for the regions
+ * next is the block control reaches after falling out of the region
+ * returns false if the region tree cannot be emitted as structured code
+ */
+bool CFGCodeGenerator::regionCodeGenerator(const Region *region,
+                                           const BasicBlock *next,
+                                           Vec<LoopContext> &loops,
+                                           const Function &f,
+                                           CodeGenInfo &function_info,
+                                           String &code) {
+  if (region == nullptr) {
+    return true;
+  }
+
+  // emit the header block of current, successors are the nested regions that
+  // are entered by its conditional branch and headerNext is the block it
+  // falls into
+  auto emitHeader = [&](const Region *current,
+                        const Vec<const Region *> &successors,
+                        const BasicBlock *headerNext) {
+    auto *bb = current->getHeader();
+    String cond;
+    code += fmt::format("/* ==== Basic block {} start ==== */\n",
+                        bb->getLabel());
+    code += fmt::format("{}:\n{{\n", bb->getLabel());
+    code += instructionCodeGenerator(bb, f, function_info, cond);
+
+    auto *br = dynamic_cast<const BranchInst *>(bb->getTerminator());
+    if (br == nullptr) {
+      code += "}\n";
+      return true;
+    }
+    if (!br->isConditional()) {
+      code += jumpCodeGenerator(br->getIfTrue(), headerNext, loops);
+      code += "}\n";
+      return true;
+    }
+
+    // evaluate the condition inside of the block and branch outside of it,
+    // so that no goto can skip over the initialization of a temporary
+    auto condVar = bb->getLabel() + "_cond";
+    conditionVars.push_back(condVar);
+    code += fmt::format("{} = {};\n}}\n", condVar, cond);
+
+    auto branchCode = [&](const BasicBlock *target, String &branch) {
+      for (auto *succ : successors) {
+        if (succ != nullptr && succ->getHeader() == target) {
+          return regionCodeGenerator(succ, next, loops, f, function_info,
+                                     branch);
+        }
+      }
+      branch += jumpCodeGenerator(target, headerNext, loops);
+      return true;
+    };
+    String trueCode, falseCode;
+    if (!branchCode(br->getIfTrue(), trueCode) ||
+        !branchCode(br->getIfFalse(), falseCode)) {
+      return false;
+    }
+    code += fmt::format(fmt::runtime(config.control["if_block"].Scalar()),
+                        fmt::arg("condition", condVar),
+                        fmt::arg("then_body", trueCode),
+                        fmt::arg("elseifs", ""),
+                        fmt::arg("else", falseCode.empty()
+                                             ? ""
+                                             : fmt::format(
+                                                   fmt::runtime(
+                                                       config.control["else"]
+                                                           .Scalar()),
+                                                   fmt::arg("else_body",
+                                                            falseCode))));
+    code += "\n";
+    return true;
+  };
+
+  if (auto *leafRegion = dynamic_cast<const LeafRegion *>(region)) {
+    return emitHeader(leafRegion, {}, next);
+  } else if (auto *sequentialRegion =
+                 dynamic_cast<const SequentialRegion *>(region)) {
+    auto nested = sequentialRegion->getNestedRegions();
+    // the header falls into the first nested region, the last one falls out
+    Vec<const BasicBlock *> nexts;
+    for (auto *nestedRegion : nested) {
+      nexts.push_back(nestedRegion->getHeader());
+    }
+    nexts.push_back(next);
+    if (!emitHeader(sequentialRegion, {}, nexts[0])) {
+      return false;
+    }
+    for (std::size_t i = 0; i < nested.size(); ++i) {
+      if (!regionCodeGenerator(nested[i], nexts[i + 1], loops, f,
+                               function_info, code)) {
+        return false;
+      }
+    }
+    return true;
+  } else if (auto *conditionalRegion =
+                 dynamic_cast<const ConditionalRegion *>(region)) {
+    auto *br = dynamic_cast<const BranchInst *>(
+        conditionalRegion->getHeader()->getTerminator());
+    if (br == nullptr || !br->isConditional()) {
+      return false;
+    }
+    // every nested region must be the target of one of the branches
+    for (auto *nestedRegion : conditionalRegion->getNestedRegions()) {
+      if (nestedRegion->getHeader() != br->getIfTrue() &&
+          nestedRegion->getHeader() != br->getIfFalse()) {
+        return false;
+      }
+    }
+    return emitHeader(conditionalRegion, conditionalRegion->getNestedRegions(),
+                      next);
+  } else if (auto *loopRegion = dynamic_cast<const LoopRegion *>(region)) {
+    String body;
+    loops.push_back({loopRegion->getHeader(), next});
+    std::swap(body, code);
+    auto *bodyRegion = loopRegion->getBodyRegion();
+    bool success =
+        emitHeader(loopRegion, {},
+                   bodyRegion ? bodyRegion->getHeader()
+                              : loopRegion->getHeader()) &&
+        regionCodeGenerator(bodyRegion, loopRegion->getHeader(), loops, f,
+                            function_info, code);
+    std::swap(body, code);
+    loops.pop_back();
+    if (!success) {
+      return false;
+    }
+    code += fmt::format(fmt::runtime(config.control["simple"].Scalar()),
+                        fmt::arg("body", body));
+    return true;
+  }
+  return false;
+}
+
 /**
  *
  */
@@ -117,10 +358,20 @@ String CFGCodeGenerator::extractVarFromChunk(const Function &func) {
 
   // just declare the local variables, they will be initialized in the basic
   // blocks also create the null indicator for each variable
+  // integer locals with a known range use the narrowest type that holds it
   i = 0;
   for (const auto &var : func.getVariables()) {
-    code +=
-        fmt::format("{} {};\n", var->getType().getCppType(), var->getName());
+    auto cppType = var->getType().getCppType();
+    auto &ranges = func.getValueRanges();
+    auto typeRange = ValueRange::ofCppType(cppType);
+    if (!var->getType().isDecimal() && typeRange &&
+        ranges.count(var->getName()) > 0) {
+      auto narrowType = ranges.at(var->getName()).narrowestCppType();
+      if (ValueRange::ofCppType(narrowType)->fitsIn(*typeRange)) {
+        cppType = narrowType;
+      }
+    }
+    code += fmt::format("{} {};\n", cppType, var->getName());
     code += fmt::format("bool {}_null = {};\n", var->getName(),
                         var->isNull() ? "true" : "false");
     ++i;
@@ -131,9 +382,35 @@ String CFGCodeGenerator::extractVarFromChunk(const Function &func) {
 
 CFGCodeGeneratorResult CFGCodeGenerator::run(const Function &f) {
   CodeGenInfo function_info;
+  bool exceptionFree = duckdb::optimizerPassOnMap.at("ExceptionFreeCodeGen");
+  function_info.exceptionFree = exceptionFree;
+  function_info.valueRanges = &f.getValueRanges();
 
-  for (auto &bbUniq : f) {
-    basicBlockCodeGenerator(&bbUniq, f, function_info);
+  // prefer structured control flow from the region tree so that the host
+  // compiler sees natural loops, fall back to a goto per edge otherwise
+  bool structured = false;
+  if (duckdb::optimizerPassOnMap.at("StructuredCodeGen") &&
+      canGenerateStructured(f)) {
+    String code;
+    Vec<LoopContext> loops;
+    structured = regionCodeGenerator(f.getRegion(), nullptr, loops, f,
+                                     function_info, code);
+    if (structured) {
+      container.basicBlockCodes.push_back(code);
+    } else {
+      INFO(fmt::format("Falling back to goto code generation for {}.",
+                       f.getFunctionName()));
+      function_info = CodeGenInfo();
+      function_info.exceptionFree = exceptionFree;
+      function_info.valueRanges = &f.getValueRanges();
+      conditionVars.clear();
+      errorStateUsed = false;
+    }
+  }
+  if (!structured) {
+    for (auto &bbUniq : f) {
+      basicBlockCodeGenerator(&bbUniq, f, function_info);
+    }
   }
   String function_args, arg_indexes, subfunc_args, subfunc_args_all_0,
       fbody_args;
@@ -173,11 +450,19 @@ CFGCodeGeneratorResult CFGCodeGenerator::run(const Function &f) {
     count++;
   }
 
-  String vector_create = "";
+  // scratch vectors live in a per-thread local state so that they are
+  // allocated once per executing thread instead of once per chunk
+  String vector_create = "", local_state = "", init_local_state = "nullptr";
   if (function_info.vectorCount > 0) {
+    local_state =
+        fmt::format(fmt::runtime(config.function["local_state"].Scalar()),
+                    fmt::arg("function_name", f.getFunctionName()),
+                    fmt::arg("vector_count", function_info.vectorCount));
+    local_state += "\n";
+    init_local_state = f.getFunctionName() + "_init_local_state";
     vector_create =
         fmt::format(fmt::runtime(config.function["vector_create"].Scalar()),
-                    fmt::arg("vector_count", function_info.vectorCount));
+                    fmt::arg("function_name", f.getFunctionName()));
     for (int i = 0; i < function_info.vectorCount; i++) {
       subfunc_args += fmt::format("tmp_chunk.data[{}], ", i);
       subfunc_args_all_0 += fmt::format("tmp_chunk.data[{}], ", i);
@@ -185,7 +470,21 @@ CFGCodeGeneratorResult CFGCodeGenerator::run(const Function &f) {
     }
   }
 
+  // errors are recorded per chunk and thrown once after the row loop
+  String error_create, error_break, error_throw;
+  if (errorStateUsed) {
+    error_create = config.function["error_create"].Scalar();
+    error_break = config.function["error_break"].Scalar();
+    error_throw = config.function["error_throw"].Scalar();
+    subfunc_args += "udf_error, ";
+    subfunc_args_all_0 += "udf_error, ";
+    fbody_args += "UDFErrorState &udf_error, ";
+  }
+
   String vars_init = extractVarFromChunk(f);
+  for (const auto &condVar : conditionVars) {
+    vars_init += fmt::format("bool {};\n", condVar);
+  }
 
   container.body = fmt::format(
       fmt::runtime(config.function["fbodyshell"].Scalar()),
@@ -202,6 +501,9 @@ CFGCodeGeneratorResult CFGCodeGenerator::run(const Function &f) {
                   fmt::arg("function_args", function_args),
                   fmt::arg("arg_indexes", arg_indexes),
                   fmt::arg("vector_create", vector_create),
+                  fmt::arg("error_create", error_create),
+                  fmt::arg("error_break", error_break),
+                  fmt::arg("error_throw", error_throw),
                   fmt::arg("subfunc_args", subfunc_args),
                   fmt::arg("subfunc_args_all_0", subfunc_args_all_0));
 
@@ -212,9 +514,11 @@ CFGCodeGeneratorResult CFGCodeGenerator::run(const Function &f) {
   container.registration = fmt::format(
       fmt::runtime(config.function["fcreate"].Scalar()),
       fmt::arg("function_name", f.getFunctionName()),
+      fmt::arg("init_local_state", init_local_state),
       fmt::arg("return_logical_type",
                f.getReturnType().getDuckDBLogicalTypeStr()),
       fmt::arg("args_logical_types", joinVector(args_logical_types, ", ")));
 
-  return {container.body + "\n" + container.main, container.registration};
+  return {local_state + container.body + "\n" + container.main,
+          container.registration};
 }
\ No newline at end of file
@@ -10,14 +10,22 @@
 #include "expression_printer.hpp"
 #include "file.hpp"
 #include "function.hpp"
+#include "global_value_numbering.hpp"
+#include "induction_variable_simplification.hpp"
+#include "inlining.hpp"
 #include "instruction_elimination.hpp"
 #include "liveness_analysis.hpp"
+#include "loop_idiom_recognition.hpp"
+#include "loop_invariant_code_motion.hpp"
+#include "loop_unswitching.hpp"
+#include "macro_generator.hpp"
 #include "merge_regions.hpp"
 #include "outlining.hpp"
 #include "pg_query.h"
 #include "predicate_analysis.hpp"
 #include "query_motion.hpp"
 #include "remove_unused_variable.hpp"
+#include "sparse_conditional_constant_propagation.hpp"
 #include "ssa_construction.hpp"
 #include "ssa_destruction.hpp"
 #include "utils.hpp"
@@ -43,22 +51,68 @@ CompilationResult Compiler::run() {
   ASSERT(functionNames.size() >= returnTypes.size(),
          "Function name not specified for all functions");
 
+  auto functions = createFunctions(functionNames, returnTypes);
+  for (std::size_t i = 0; i < functions.size(); ++i) {
+    if (!optimize(*functions[i], true)) {
+      // the lowering to a SQL expression failed after changing the function,
+      // it is built again and replaces the one that was changed
+      auto rebuilt = createFunctions(functionNames, returnTypes, i);
+      functions[i] = std::move(rebuilt[i]);
+      optimize(*functions[i], false);
+    }
+  }
+  codeRes.success = true;
+  codeRes.macros = macros;
+  return codeRes;
+}
+
+VecOwn<Function> Compiler::createFunctions(const Vec<String> &functionNames,
+                                           const Vec<String> &returnTypes,
+                                           Opt<std::size_t> only) {
   auto asts = parseJson();
-  VecOwn<Function> functions;
+  VecOwn<Function> functions(functionNames.size());
 
   AstToCFG astToCFG(conn, programText);
-  for (std::size_t i = 0; i < functionNames.size(); ++i) {
-    auto ast = asts[i];
-    auto function =
-        astToCFG.createFunction(ast, functionNames[i], returnTypes[i]);
-    functions.emplace_back(std::move(function));
+  auto createFunction = [&](std::size_t i) {
+    functions[i] =
+        astToCFG.createFunction(asts[i], functionNames[i], returnTypes[i]);
+  };
+  if (only) {
+    // the function and the UDFs it reaches through calls, which are inlined
+    // into it
+    createFunction(*only);
+    Vec<std::size_t> worklist = {*only};
+    while (!worklist.empty()) {
+      auto &caller = *functions[worklist.back()];
+      worklist.pop_back();
+      for (std::size_t i = 0; i < functionNames.size(); ++i) {
+        if (!functions[i] && InliningPass::calls(caller, functionNames[i])) {
+          createFunction(i);
+          worklist.push_back(i);
+        }
+      }
+    }
+  } else {
+    for (std::size_t i = 0; i < functionNames.size(); ++i) {
+      createFunction(i);
+    }
   }
 
+  // Inline the calls between the UDFs, callees first so that chains of calls
+  // collapse into a single body
+  Map<String, Function *> udfs;
+  Vec<Function *> functionList;
   for (auto &f : functions) {
-    optimize(*f);
+    if (f) {
+      udfs.insert({toLower(f->getFunctionName()), f.get()});
+      functionList.push_back(f.get());
+    }
   }
-  codeRes.success = true;
-  return codeRes;
+  auto inlining = Make<PipelinePass>(Make<InliningPass>(udfs));
+  for (auto *f : InliningPass::getBottomUpOrder(functionList, udfs)) {
+    inlining->runOnFunction(*f);
+  }
+  return functions;
 }
 
 CompilationResult Compiler::runOnFunction(Function &f) {
@@ -86,13 +140,35 @@ json Compiler::parseJson() const {
   return json;
 }
 
-void Compiler::optimize(Function &f) {
+static bool isLoopFree(const Region *region) {
+  if (region == nullptr || dynamic_cast<const LoopRegion *>(region) ||
+      dynamic_cast<const DummyRegion *>(region)) {
+    return false;
+  }
+  if (auto *rec = dynamic_cast<const RecursiveRegion *>(region)) {
+    for (auto *nested : rec->getNestedRegions()) {
+      if (!isLoopFree(nested)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool Compiler::optimize(Function &f, bool allowDeclarative) {
 
   auto ssaConstruction =
-      Make<PipelinePass>(Make<MergeRegionsPass>(), Make<SSAConstructionPass>());
+      Make<PipelinePass>(Make<MergeRegionsPass>(), Make<LoopUnswitchingPass>(),
+                         Make<SSAConstructionPass>());
+
+  auto constantPropagation =
+      Make<PipelinePass>(Make<SparseConditionalConstantPropagationPass>());
 
   auto coreOptimizations = Make<FixpointPass>(Make<PipelinePass>(
-      Make<InstructionEliminationPass>(), Make<DeadCodeEliminationPass>()));
+      Make<InstructionEliminationPass>(), Make<GlobalValueNumberingPass>(),
+      Make<LoopInvariantCodeMotionPass>(),
+      Make<InductionVariableSimplificationPass>(),
+      Make<LoopIdiomRecognitionPass>(), Make<DeadCodeEliminationPass>()));
 
   auto aggifyPipeline = Make<PipelinePass>(Make<AggifyPass>(*this),
                                            Make<DeadCodeEliminationPass>());
@@ -116,6 +192,9 @@ void Compiler::optimize(Function &f) {
   // Convert to SSA
   ssaConstruction->runOnFunction(f);
 
+  // Fold constants and remove the branches that are never taken
+  constantPropagation->runOnFunction(f);
+
   // Run the core optimizations
   coreOptimizations->runOnFunction(f);
 
@@ -127,11 +206,23 @@ void Compiler::optimize(Function &f) {
     std::cout << pred << std::endl;
   }
 
+  // A loop-free UDF can run as a single CASE expression in its macro, it is
+  // only outlined when the compiled code is cheaper
+  bool declarative =
+      allowDeclarative &&
+      duckdb::optimizerPassOnMap.at("DeclarativeInlining") == true &&
+      duckdb::optimizerPassOnMap.at("MacroRegistration") == true &&
+      isLoopFree(f.getRegion()) && !OutliningPass(*this).isWorthOutlining(f);
+
   // Now perform outlining
   aggifyPipeline->runOnFunction(f);
   beforeOutliningPipeline->runOnFunction(f);
   rightBeforeOutliningPipeline->runOnFunction(f);
-  outliningPipeline->runOnFunction(f);
+  if (declarative) {
+    INFO(fmt::format("Inlining {} as a SQL expression.", f.getFunctionName()));
+  } else {
+    outliningPipeline->runOnFunction(f);
+  }
 
   // Finally get out of SSA
   ssaDestructionPipeline->runOnFunction(f);
@@ -139,12 +230,28 @@ void Compiler::optimize(Function &f) {
   // clean up the variable list
   finalCleanUpPipeline->runOnFunction(f);
 
+  // Register the optimized UDF under its original name, a UDF that was not
+  // outlined has to be compiled again when its macro cannot be generated
+  if (duckdb::optimizerPassOnMap.at("MacroRegistration") == true) {
+    MacroGenerator macroGenerator(config);
+    if (auto macro = macroGenerator.run(f)) {
+      macros += *macro;
+    } else if (declarative) {
+      INFO(fmt::format("Cannot inline {} as a SQL expression, outlining it.",
+                       f.getFunctionName()));
+      return false;
+    } else {
+      INFO(fmt::format("Cannot register {} as a macro.", f.getFunctionName()));
+    }
+  }
+
   // Compile the UDF to PL/SQL
   PLpgSQLGenerator plpgsqlGenerator(config);
   auto plpgsqlRes = plpgsqlGenerator.run(f);
   std::cout << "----------- PLpgSQL code start -----------\n";
   std::cout << plpgsqlRes.code << std::endl;
   std::cout << "----------- PLpgSQL code end-----------\n";
+  return true;
 }
 
 /**
@@ -0,0 +1,59 @@
+#include "global_value_numbering.hpp"
+#include "dominator_analysis.hpp"
+#include "instructions.hpp"
+
+bool GlobalValueNumberingPass::runOnFunction(Function &f) {
+  bool changed = false;
+
+  DominatorAnalysis dominatorAnalysis(f);
+  dominatorAnalysis.runAnalysis();
+  auto &dominatorTree = dominatorAnalysis.getDominatorTree();
+
+  // in SSA form two pure expressions with the same text and type compute the
+  // same value, the available ones are scoped by the dominator tree
+  Map<String, const Variable *> available;
+  auto getKey = [](const SelectExpression *expr) {
+    return expr->getReturnType().serialize() + ":" + expr->getRawSQL();
+  };
+
+  std::function<void(BasicBlock *)> visit = [&](BasicBlock *block) -> void {
+    Vec<String> inserted;
+    for (auto it = block->begin(); it != block->end(); ++it) {
+      auto *assign = dynamic_cast<const Assignment *>(&*it);
+      if (assign == nullptr || assign->getRHS()->isTrivial() ||
+          !assign->getRHS()->isPure()) {
+        continue;
+      }
+      // the entry block reads the arguments into their SSA versions
+      const auto &used = assign->getRHS()->getUsedVariables();
+      if (block == f.getEntryBlock() &&
+          std::any_of(used.begin(), used.end(), [&](const Variable *var) {
+            return f.isArgument(var);
+          })) {
+        continue;
+      }
+      auto key = getKey(assign->getRHS());
+      if (available.find(key) == available.end()) {
+        available.insert({key, assign->getLHS()});
+        inserted.push_back(key);
+        continue;
+      }
+      // reuse the dominating computation
+      auto *leader = available.at(key);
+      auto copy = f.bindExpression(leader->getName(),
+                                   assign->getRHS()->getReturnType());
+      it = block->replaceInst(
+          it, Make<Assignment>(assign->getLHS(), std::move(copy)));
+      changed = true;
+    }
+    for (auto &child : dominatorTree->getChildren(block->getLabel())) {
+      visit(f.getBlockFromLabel(child));
+    }
+    for (auto &key : inserted) {
+      available.erase(key);
+    }
+  };
+  visit(f.getEntryBlock());
+
+  return changed;
+}
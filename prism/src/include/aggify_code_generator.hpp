@@ -17,6 +17,8 @@ using json = nlohmann::json;
 struct AggifyCodeGeneratorResult : CFGCodeGeneratorResult {
   // name of the custom aggregate
   String name;
+  // whether the result depends on the order of the rows
+  bool orderDependent;
 };
 
 /**
@@ -24,7 +26,19 @@ struct AggifyCodeGeneratorResult : CFGCodeGeneratorResult {
  */
 class AggifyCodeGenerator : public CFGCodeGenerator {
 private:
+  /**
+   * How the loop body updates a state variable, the updates of a loop with
+   * only these patterns can be computed per thread and merged in any order
+   */
+  enum class Accumulator { READ_ONLY, SUM, MIN, MAX, AND, OR };
+
   Vec<String> getOrginalCursorLoopCol(const json &ast);
+  Opt<Accumulator> getAccumulator(const duckdb::Expression &expr,
+                                  const Variable *var) const;
+  Opt<Map<const Variable *, Accumulator>>
+  getAccumulators(Function &f, const Vec<const Variable *> &stateVars) const;
+  String getCombine(const Map<const Variable *, Accumulator> &accumulators,
+                    const Vec<const Variable *> &stateVars) const;
 
 public:
   AggifyCodeGenerator(const YAMLConfig &_config) : CFGCodeGenerator(_config) {}
@@ -32,5 +46,6 @@ public:
   AggifyCodeGeneratorResult run(Function &f, const json &ast,
                                 Vec<const Variable *> cursorVars,
                                 Vec<const Variable *> usedVars,
-                                const Variable *retVariable, size_t id);
+                                const Variable *retVariable, size_t id,
+                                bool earlyExit);
 };
\ No newline at end of file
@@ -7,6 +7,11 @@ class Compiler;
 
 using SelectRegions = Map<const Region *, bool>;
 
+struct OrderedFetch {
+  String query;
+  String orderBy;
+};
+
 class AggifyPass : public FunctionPass {
 public:
   AggifyPass(Compiler &compiler) : FunctionPass(), compiler(compiler) {}
@@ -15,6 +20,15 @@ public:
 
   String getPassName() const override { return "AggifyPass"; }
 
+  /**
+   * The fetch query with the keys of its ORDER BY selected as extra columns
+   * and the ORDER BY clause over them, which is empty if the query has none
+   * Positions in the ORDER BY refer to the columns fetchQueryVar<i>, returns
+   * nullopt if the order can't be extracted
+   */
+  static Opt<OrderedFetch> orderFetchQuery(const String &fetchQuery,
+                                           std::size_t fieldCount);
+
 private:
   String
   outlineCursorLoop(Function &newFunction, Vec<BasicBlock *> loopBodyBlocks,
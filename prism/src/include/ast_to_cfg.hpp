@@ -27,6 +27,17 @@ public:
   Own<Function> createFunction(const json &ast, const String &name,
                                const String &returnType);
 
+  /**
+   * The condition of a cursor loop and the fetch of one field of its current
+   * row, the macro generator matches them to read a materialized cursor
+   */
+  static constexpr char CURSOR_LOOP_CONDITION[] =
+      "select ANY_VALUE(cursorloopiter) < count(*) from tmp, "
+      "/*fetchQueryStart*/{fetchQuery}/*fetchQueryEnd*/ cursorloopEmptyTmp";
+  static constexpr char CURSOR_LOOP_FIELD[] =
+      "SELECT {field} FROM ({fetchQuery}) fetchQueryTmpTable({columns}) "
+      "WHERE cursorloopiter::BOOL";
+
 private:
   static constexpr char MAGIC_HEADER[] = "PLpgSQL_function";
   static constexpr char ASSIGNMENT_PATTERN[] = "\\:?\\=";
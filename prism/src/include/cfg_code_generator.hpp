@@ -25,6 +25,15 @@ public:
   String registration;
 };
 
+/**
+ * The innermost loop enclosing the code being emitted, a jump to its header
+ * becomes a continue and a jump to its exit becomes a break
+ */
+struct LoopContext {
+  const BasicBlock *header;
+  const BasicBlock *exit;
+};
+
 struct CFGCodeGeneratorResult {
   // the main definition of the custom aggregate
   String code;
@@ -45,6 +54,21 @@ public:
   CFGCodeGeneratorResult run(const Function &func);
 
 private:
+  // the boolean variables holding the branch conditions in structured mode
+  Vec<String> conditionVars;
+  // whether any generated expression records errors in udf_error
+  bool errorStateUsed = false;
+
   String createReturnValue(const String &retName, const Type &retType,
                            const String &retValue);
+  String createStructReturnValue(const String &retName, const Type &retType);
+  String instructionCodeGenerator(BasicBlock *bb, const Function &func,
+                                  CodeGenInfo &function_info, String &cond);
+  String errorCheckCodeGenerator(CodeGenInfo &function_info);
+  bool canGenerateStructured(const Function &func) const;
+  String jumpCodeGenerator(const BasicBlock *target, const BasicBlock *next,
+                           const Vec<LoopContext> &loops) const;
+  bool regionCodeGenerator(const Region *region, const BasicBlock *next,
+                           Vec<LoopContext> &loops, const Function &func,
+                           CodeGenInfo &function_info, String &code);
 };
\ No newline at end of file
@@ -16,6 +16,8 @@ using json = nlohmann::json;
 
 struct CompilationResult : CFGCodeGeneratorResult {
   bool success;
+  // the statements registering the optimized UDFs under their original names
+  String macros;
 };
 
 class Compiler {
@@ -31,7 +33,11 @@ public:
 
   CFGCodeGeneratorResult generateCode(const Function &function);
 
-  void optimize(Function &f);
+  /**
+   * Returns false when the UDF was to be inlined as a SQL expression but its
+   * macro could not be generated, it must then be optimized again without
+   */
+  bool optimize(Function &f, bool allowDeclarative);
 
   inline size_t &getUdfCount() { return udfCount; }
   inline duckdb::Connection *getConnection() { return conn; }
@@ -47,9 +53,17 @@ public:
 
 private:
   json parseJson() const;
+  /**
+   * Builds the CFGs of the UDFs and inlines the calls between them, with only
+   * set just that UDF and its callees are built, the others are nullptr
+   */
+  VecOwn<Function> createFunctions(const Vec<String> &functionNames,
+                                   const Vec<String> &returnTypes,
+                                   Opt<std::size_t> only = std::nullopt);
 
   duckdb::Connection *conn;
   String programText;
   const YAMLConfig &config;
   size_t &udfCount;
+  String macros;
 };
@@ -5,6 +5,7 @@
 #include "region.hpp"
 #include "use_def_analysis.hpp"
 #include "utils.hpp"
+#include "value_range.hpp"
 
 class BasicBlockIterator {
   using iterator_category = std::bidirectional_iterator_tag;
@@ -115,6 +116,10 @@ struct FunctionCloneAndRenameHelper {
   Map<BasicBlock *, BasicBlock *> basicBlockMap;
 };
 
+template <>
+Own<Instruction>
+FunctionCloneAndRenameHelper::cloneAndRename(const Instruction &inst);
+
 class Function {
 public:
   Function(duckdb::Connection *conn, const String &name, const Type &returnType)
@@ -173,6 +178,11 @@ public:
   void setRegion(Own<Region> region) { functionRegion = std::move(region); }
   Region *getRegion() const { return functionRegion.get(); }
 
+  void setValueRanges(Map<String, ValueRange> ranges) {
+    valueRanges = std::move(ranges);
+  }
+  const Map<String, ValueRange> &getValueRanges() const { return valueRanges; }
+
   void addArgument(const String &name, Type type) {
     auto cleanedName = getCleanedVariableName(name);
     auto var = Make<Variable>(cleanedName, type);
@@ -199,6 +209,12 @@ public:
     declarations.emplace_back(std::move(assignment));
   }
 
+  /**
+   * The variable that a renamed variable stands for, everything before the
+   * first "__": SSA versions (x__1__) and the per-exit copies of the fields of
+   * an outlined STRUCT (x__exit0) are merged back into x by SSA destruction,
+   * which is why source variable names must not contain "__"
+   */
   static String getOriginalName(const String &ssaName) {
     return ssaName.substr(0, ssaName.find("__"));
   };
@@ -373,4 +389,5 @@ private:
   VecOwn<BasicBlock> basicBlocks;
   Map<String, BasicBlock *> labelToBasicBlock;
   Own<Region> functionRegion;
+  Map<String, ValueRange> valueRanges;
 };
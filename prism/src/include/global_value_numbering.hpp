@@ -0,0 +1,17 @@
+#pragma once
+
+#include "function_pass.hpp"
+#include "utils.hpp"
+
+/**
+ * Replaces a pure expression that is already computed by a dominating
+ * definition with a copy of that definition (operates on SSA form)
+ */
+class GlobalValueNumberingPass : public FunctionPass {
+public:
+  GlobalValueNumberingPass() : FunctionPass() {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override { return "GlobalValueNumbering"; }
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "duckdb/planner/expression.hpp"
+#include "function_pass.hpp"
+#include "region.hpp"
+#include "utils.hpp"
+
+/**
+ * Replaces counted loops that only compute affine recurrences (counters, sums
+ * of the induction variable, ...) by their closed form (operates on SSA form)
+ */
+class InductionVariableSimplificationPass : public FunctionPass {
+public:
+  InductionVariableSimplificationPass() : FunctionPass() {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override {
+    return "InductionVariableSimplification";
+  }
+
+  /**
+   * coefficient * iv + offset as SQL over HUGEINT, the constants are kept
+   * when the parts are known at compile time
+   */
+  struct Affine {
+    String coefficient;
+    String offset;
+    Opt<int64_t> constantCoefficient;
+    Opt<int64_t> constantOffset;
+  };
+
+private:
+  struct LoopInfo {
+    Set<BasicBlock *> blocks;
+    // the assignments of the loop body
+    Map<const Variable *, const duckdb::Expression *> definitions;
+    const Variable *inductionVariable;
+  };
+
+  Opt<Affine> getAffine(Function &f, const duckdb::Expression &expr,
+                        const LoopInfo &info) const;
+  Opt<Affine> getIncrement(Function &f, const duckdb::Expression &expr,
+                           const Variable *var, const LoopInfo &info) const;
+  bool simplifyLoop(Function &f, LoopRegion *loop);
+};
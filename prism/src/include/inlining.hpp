@@ -0,0 +1,56 @@
+#pragma once
+
+#include "function_pass.hpp"
+#include "region.hpp"
+#include "utils.hpp"
+
+/**
+ * Inlines the calls to the other UDFs of the program into the CFG of the
+ * caller, so that the combined body is optimized as a whole (runs before SSA
+ * construction)
+ */
+class InliningPass : public FunctionPass {
+public:
+  InliningPass(const Map<String, Function *> &udfs)
+      : FunctionPass(), udfs(udfs) {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override { return "Inlining"; }
+
+  /**
+   * Whether the function calls the UDF with the given name directly
+   */
+  static bool calls(Function &f, const String &name);
+
+  /**
+   * The UDFs called directly from the function (the edges of the call graph)
+   */
+  static Vec<Function *> getCallees(Function &f,
+                                    const Map<String, Function *> &udfs);
+
+  /**
+   * The functions ordered such that callees come before their callers, calls
+   * on a cycle of the call graph are ignored
+   */
+  static Vec<Function *>
+  getBottomUpOrder(const Vec<Function *> &functions,
+                   const Map<String, Function *> &udfs);
+
+  static constexpr std::size_t MAX_CALLEE_SIZE = 128;
+
+private:
+  struct CallSite {
+    std::size_t start;
+    std::size_t length;
+    Vec<String> args;
+  };
+
+  bool canInline(Function &callee) const;
+  Opt<CallSite> findCallSite(const SelectExpression *expr,
+                             const Function &callee) const;
+  bool inlineCall(Function &f, BasicBlock *block, Instruction *inst,
+                  const CallSite &callSite, Function &callee);
+
+  const Map<String, Function *> &udfs;
+};
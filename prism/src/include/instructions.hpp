@@ -77,6 +77,16 @@ public:
         rawSQL, std::regex("\\bFROM\\b", std::regex_constants::icase));
   }
 
+  /**
+   * A constant or a single variable, cheap enough to copy into every use
+   */
+  bool isTrivial() const;
+
+  /**
+   * No query and no volatile function, so equal text means equal value
+   */
+  bool isPure() const;
+
   String getRawSQL() const { return rawSQL; }
 
   const LogicalPlan *getLogicalPlan() const { return logicalPlan.get(); }
@@ -16,6 +16,19 @@ public:
 
   int tmpVarCount = 0;
 
+  /**
+   * record errors in udf_error instead of throwing inside the row loop
+   */
+  bool exceptionFree = false;
+  /**
+   * whether the expressions generated since the last reset can record an error
+   */
+  bool mayFail = false;
+  /**
+   * ranges of the variables from RangeAnalysis, used to drop overflow checks
+   */
+  const Map<String, ValueRange> *valueRanges = nullptr;
+
   String newVector() {
     // make sure it is does not already exist
     return "tmp_vec" + std::to_string(vectorCount++);
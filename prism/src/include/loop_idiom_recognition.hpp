@@ -0,0 +1,45 @@
+#pragma once
+
+#include "duckdb/planner/expression.hpp"
+#include "function_pass.hpp"
+#include "region.hpp"
+#include "utils.hpp"
+
+/**
+ * Replaces loops that walk over the elements of a delimited string and return
+ * as soon as one element satisfies a condition by a single list expression
+ * over the positions of the delimiter (operates on SSA form)
+ */
+class LoopIdiomRecognitionPass : public FunctionPass {
+public:
+  LoopIdiomRecognitionPass() : FunctionPass() {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override { return "LoopIdiomRecognition"; }
+
+private:
+  using Definitions = Map<const Variable *, const SelectExpression *>;
+
+  struct SplitLoop {
+    Set<BasicBlock *> blocks;
+    // the assignments of the loop body
+    Definitions definitions;
+    // the remaining string and the position of the next delimiter
+    const Variable *rest;
+    const Variable *position;
+    // the value of rest on the next iteration
+    const Variable *nextRest;
+    String init;
+    String delimiter;
+  };
+
+  bool matchesNextRest(Function &f, const duckdb::Expression &expr,
+                       const SplitLoop &info) const;
+  bool matchesPosition(Function &f, const duckdb::Expression &expr,
+                       const Variable *string,
+                       const Definitions &definitions, SplitLoop &info) const;
+  Opt<String> expand(const SelectExpression *expr, const SplitLoop &info,
+                     const Map<String, String> &closedForms) const;
+  bool rewriteLoop(Function &f, LoopRegion *loop);
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "function_pass.hpp"
+#include "region.hpp"
+#include "utils.hpp"
+
+/**
+ * Hoists pure loop-invariant assignments and branch conditions out of loops
+ * into the loop preheader (operates on SSA form)
+ */
+class LoopInvariantCodeMotionPass : public FunctionPass {
+public:
+  LoopInvariantCodeMotionPass() : FunctionPass() {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override { return "LoopInvariantCodeMotion"; }
+
+  /**
+   * The unique block outside of the loop jumping to its header, a new block
+   * is inserted on the edge if that block has other successors
+   * Returns nullptr if the loop is entered from more than one block
+   */
+  static BasicBlock *getPreheader(Function &f, LoopRegion *loop);
+
+  /**
+   * The unique block outside of the loop jumping to its header, without
+   * changing the CFG, nullptr if there is none
+   */
+  static BasicBlock *getLoopEntry(LoopRegion *loop);
+
+  /**
+   * Whether evaluating the expression can never raise an error, so that it is
+   * safe to evaluate even when the original code would not
+   */
+  static bool canSpeculate(const SelectExpression *expr);
+
+  /**
+   * The loops of the region tree, inner loops before the loops containing them
+   */
+  static Vec<LoopRegion *> getLoops(Function &f);
+
+private:
+  bool hoistFromLoop(Function &f, LoopRegion *loop, BasicBlock *entry,
+                     Map<BasicBlock *, BasicBlock *> &idom,
+                     Map<const Variable *, BasicBlock *> &defBlocks);
+};
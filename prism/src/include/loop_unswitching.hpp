@@ -0,0 +1,28 @@
+#pragma once
+
+#include "function_pass.hpp"
+#include "region.hpp"
+#include "utils.hpp"
+
+/**
+ * Moves a branch on a loop-invariant condition out of the loop by testing it
+ * once before the loop and entering one of two copies of the loop
+ * It runs before SSA construction (so the copies need no phi nodes), the
+ * copies branch on a constant which constant propagation then removes
+ */
+class LoopUnswitchingPass : public FunctionPass {
+public:
+  LoopUnswitchingPass() : FunctionPass() {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override { return "LoopUnswitching"; }
+
+private:
+  // loops with more instructions are not duplicated
+  static constexpr std::size_t MAX_LOOP_SIZE = 64;
+
+  BasicBlock *findInvariantBranch(LoopRegion *loop) const;
+  void unswitchLoop(Function &f, LoopRegion *loop, BasicBlock *preheader,
+                    BasicBlock *branchBlock);
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "function.hpp"
+#include "utils.hpp"
+
+/**
+ * Lowers an optimized UDF to a DuckDB macro under its original name, so that
+ * queries use the rewritten body (and the outlined functions) directly
+ * Conditional regions become CASE expressions over the values of both branches
+ * and loops become recursive CTEs over the state of the function, the fetch
+ * query of a cursor loop is materialized once and read by position
+ */
+class MacroGenerator {
+public:
+  MacroGenerator(const YAMLConfig &config) : config(config) {}
+
+  /**
+   * The CREATE MACRO statement, if the body can be written as one expression
+   */
+  Opt<String> run(const Function &f) const;
+
+  static constexpr std::size_t MAX_MACRO_SIZE = 1 << 16;
+
+private:
+  /**
+   * The symbolic state of the function after a region: the expression of each
+   * variable, whether the function has returned and the value it returned
+   * Inside a loop, whether the iteration has left the loop or continued
+   */
+  struct MacroState {
+    Map<String, String> values;
+    String returned = "false";
+    String result;
+    String exited = "false";
+    String continued = "false";
+  };
+
+  /**
+   * The fetch query of a cursor loop, materialized once as a CTE whose rows
+   * are read by their position
+   */
+  struct Cursor {
+    String name;
+    String columns;
+  };
+
+  struct LoweringContext {
+    // the recursive CTEs of the loops lowered so far
+    Vec<String> ctes;
+    String lastResult;
+    // the loop whose body is being lowered
+    const LoopRegion *loop = nullptr;
+    bool conditional = false;
+    // the cursors of the loop by their fetch query
+    Map<String, Cursor> cursors;
+  };
+
+  String readCursors(const String &text, LoweringContext &context) const;
+  String lowerExpression(const String &text, const MacroState &state,
+                         LoweringContext &context) const;
+  MacroState merge(const String &cond, const MacroState &trueState,
+                   const MacroState &falseState) const;
+  void jumpTo(const BasicBlock *target, MacroState &state,
+              const LoweringContext &context) const;
+  bool lowerBlock(const Function &f, const BasicBlock *block,
+                  MacroState &state, LoweringContext &context) const;
+  bool lowerLoop(const Function &f, const LoopRegion *loop, MacroState &state,
+                 LoweringContext &context) const;
+  bool lowerRegion(const Function &f, const Region *region, MacroState &state,
+                   LoweringContext &context) const;
+
+  const YAMLConfig &config;
+};
@@ -12,8 +12,40 @@ public:
   bool runOnFunction(Function &f) override;
   String getPassName() const override { return "OutliningPass"; }
 
+  // relative per-row costs of the cost model for outlining, hand-picked
+  // estimates in units of one compiled C++ operator, only their ratios matter
+  // an interpreted SQL operator materializes a vector per operator, taken as
+  // four compiled operators
+  static constexpr std::size_t SQL_EXPRESSION_COST = 4;
+  // one compiled operator, the unit of the model
+  static constexpr std::size_t CPP_EXPRESSION_COST = 1;
+  // dispatching the outlined scalar function and unpacking its result
+  static constexpr std::size_t CALL_COST = 16;
+  // reading one argument vector in the row loop of the outlined function
+  static constexpr std::size_t ARGUMENT_COST = 2;
+  // loops left in SQL become recursive CTEs, every iteration materializes
+  // the working table of the CTE
+  static constexpr std::size_t SQL_LOOP_COST = 64;
+  // trip counts are unknown when compiling, every loop is assumed to run this
+  // many times
+  static constexpr std::size_t ESTIMATED_LOOP_ITERATIONS = 16;
+  // binding and optimizing an inlined statement happens once per calling
+  // query, so it is spread over the rows the query is assumed to process
+  static constexpr std::size_t PLANNING_COST = 100000;
+  static constexpr std::size_t ESTIMATED_CALLER_ROWS = 10000;
+
+  /**
+   * Whether compiling the whole function is cheaper than evaluating it as a
+   * single SQL expression, which is planned once with the calling query
+   */
+  bool isWorthOutlining(Function &f) const;
+
 private:
+  bool isWorthOutlining(const Vec<BasicBlock *> &basicBlocks,
+                        std::size_t numArgs, bool planStatements = true) const;
   SelectRegions computeSelectRegions(const Region *root) const;
+  bool hoistQueries(BasicBlock *header, const Vec<BasicBlock *> &queuedBlocks,
+                    Function &f) const;
   void outlineFunction(Function &f);
   bool outlineBasicBlocks(Vec<BasicBlock *> basicBlocks, Function &f);
   bool runOnRegion(SelectRegions &selectRegions, const Region *rootRegion,
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "analysis.hpp"
+#include "compiler_fmt/core.h"
+#include "compiler_fmt/ostream.h"
+#include "duckdb/planner/expression.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "function.hpp"
+#include "utils.hpp"
+#include "value_range.hpp"
+
+/**
+ * Returns the range of a variable given its name, std::nullopt if unknown
+ */
+using RangeLookup = std::function<Opt<ValueRange>(const String &)>;
+
+class VariableRanges {
+public:
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const VariableRanges &ranges) {
+    ranges.print(os);
+    return os;
+  }
+
+  void setRange(const Variable *var, const ValueRange &range) {
+    ranges.insert_or_assign(var, range);
+  }
+
+  Opt<ValueRange> getRange(const Variable *var) const {
+    if (ranges.find(var) == ranges.end()) {
+      return std::nullopt;
+    }
+    return ranges.at(var);
+  }
+
+  /**
+   * Join the ranges of all SSA versions of a variable, so that they stay valid
+   * for the variable after SSA destruction
+   */
+  Map<String, ValueRange> getRangesByOriginalName() const {
+    Map<String, ValueRange> result;
+    for (auto &[var, range] : ranges) {
+      auto name = Function::getOriginalName(var->getName());
+      if (result.find(name) == result.end()) {
+        result.insert({name, range});
+      } else {
+        result.insert_or_assign(name, result.at(name).join(range));
+      }
+    }
+    return result;
+  }
+
+protected:
+  void print(std::ostream &os) const {
+    for (auto &[var, range] : ranges) {
+      fmt::print(os, "Range({}) = {}\n", var->getName(), fmt::streamed(range));
+    }
+  }
+
+private:
+  Map<const Variable *, ValueRange> ranges;
+};
+
+/**
+ * Computes the range of every integer variable of a function in SSA form
+ * The ranges are seeded from the argument types and constants, and refined
+ * with the comparisons guarding the branches that dominate each definition
+ * (e.g. the condition of a FOR loop bounds its induction variable)
+ */
+class RangeAnalysis : public Analysis {
+public:
+  RangeAnalysis(Function &f) : Analysis(f) {}
+
+  void runAnalysis() override;
+
+  const Own<VariableRanges> &getVariableRanges() const {
+    return variableRanges;
+  }
+
+  /**
+   * The range of an integer expression (clamped to its type)
+   */
+  static Opt<ValueRange> evaluate(const duckdb::Expression &expr,
+                                  const RangeLookup &lookup);
+
+  /**
+   * The range of an arithmetic function before any overflow check is applied
+   */
+  static Opt<ValueRange>
+  evaluateUnchecked(const duckdb::BoundFunctionExpression &expr,
+                    const RangeLookup &lookup);
+
+  static Opt<ValueRange> getTypeRange(const duckdb::LogicalType &type);
+
+private:
+  // number of updates of a variable before widening it to its type range
+  static constexpr std::size_t WIDENING_THRESHOLD = 3;
+  // number of passes over the function that narrow the widened ranges
+  static constexpr std::size_t NARROWING_ROUNDS = 3;
+
+  using Guard = std::pair<const duckdb::Expression *, bool>;
+
+  Vec<Guard> getGuards(BasicBlock *block,
+                       const Map<BasicBlock *, BasicBlock *> &idom) const;
+  Opt<ValueRange> refine(const Variable *var, ValueRange range,
+                         const duckdb::Expression &cond, bool truth,
+                         const RangeLookup &lookup) const;
+
+  Own<VariableRanges> variableRanges;
+};
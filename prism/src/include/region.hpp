@@ -147,6 +147,33 @@ public:
     }
   }
 
+  /**
+   * Give up ownership of a nested region, leaving a nullptr in its place
+   */
+  Own<Region> releaseNestedRegion(const Region *toRelease) {
+    for (auto &region : nestedRegions) {
+      if (region.get() == toRelease) {
+        return std::move(region);
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Replace a nested region with the region returned by wrap, which takes
+   * ownership of it
+   */
+  void wrapNestedRegion(const Region *toWrap,
+                        const std::function<Own<Region>(Own<Region>)> &wrap) {
+    for (auto &region : nestedRegions) {
+      if (region.get() == toWrap) {
+        region = wrap(std::move(region));
+        region->setParentRegion(this);
+        return;
+      }
+    }
+  }
+
   void removeNestedRegions(Set<Region *> regionsToRemove) {
     auto it = nestedRegions.begin();
     while (it != nestedRegions.end()) {
@@ -323,6 +350,18 @@ protected:
   }
 };
 
+// The innermost loop region containing the block, nullptr if there is none
+inline LoopRegion *getEnclosingLoop(const BasicBlock *block) {
+  Region *region = block->getRegion();
+  while (region != nullptr) {
+    if (auto *loop = dynamic_cast<LoopRegion *>(region)) {
+      return loop;
+    }
+    region = region->getParentRegion();
+  }
+  return nullptr;
+}
+
 inline String getRegionString(Region *region) {
   std::stringstream ss;
   ss << "digraph region {";
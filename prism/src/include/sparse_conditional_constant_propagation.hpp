@@ -0,0 +1,46 @@
+#pragma once
+
+#include "function_pass.hpp"
+#include "utils.hpp"
+
+/**
+ * Sparse conditional constant propagation on SSA form
+ * Constant subexpressions are folded by DuckDB when the expression is bound,
+ * branches on a constant condition are removed along with the region behind
+ * the edge that is never taken
+ */
+class SparseConditionalConstantPropagationPass : public FunctionPass {
+public:
+  SparseConditionalConstantPropagationPass() : FunctionPass() {}
+
+  bool runOnFunction(Function &f) override;
+
+  String getPassName() const override {
+    return "SparseConditionalConstantPropagation";
+  }
+
+  struct LatticeValue {
+    enum class Kind { UNDEFINED, CONSTANT, OVERDEFINED };
+    Kind kind;
+    // the SQL literal of a constant
+    String constant;
+  };
+
+private:
+  LatticeValue getValue(const Variable *var) const;
+  bool setValue(const Variable *var, const LatticeValue &value);
+  LatticeValue evaluate(Function &f, const SelectExpression *expr);
+  const SelectExpression *getConstantExpression(Function &f,
+                                                const Variable *var);
+  bool markEdge(BasicBlock *from, BasicBlock *to);
+
+  bool removeDeadBranch(Function &f, BasicBlock *header, BasicBlock *taken,
+                        BasicBlock *dead);
+
+  Map<const Variable *, LatticeValue> lattice;
+  Map<const Variable *, Own<SelectExpression>> constantExpressions;
+  Set<BasicBlock *> executable;
+  Map<BasicBlock *, Set<BasicBlock *>> executableEdges;
+  // the successor taken by blocks that branch on a constant condition
+  Map<BasicBlock *, BasicBlock *> constantBranches;
+};
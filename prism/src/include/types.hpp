@@ -37,6 +37,7 @@ enum class PostgresTypeTag {
   LONG,
   NUMERIC,
   REAL,
+  RECORD,
   SHORT,
   SIGNED,
   SMALLINT,
@@ -67,6 +68,7 @@ enum class DuckdbTypeTag {
   INTERVAL,
   REAL,
   SMALLINT,
+  STRUCT,
   TIME,
   TIMESTAMP,
   TINYINT,
@@ -92,7 +94,8 @@ enum class CppTypeTag {
   UINT32_T,
   UINT64_T,
   UINT8_T,
-  DATE_T
+  DATE_T,
+  VALUE
 };
 
 std::ostream &operator<<(std::ostream &os, DuckdbTypeTag);
@@ -120,7 +123,8 @@ public:
 
   static Type fromString(const String &str) {
     auto tag = getPostgresTag(str);
-    if (tag == PostgresTypeTag::DECIMAL) {
+    if (tag == PostgresTypeTag::DECIMAL ||
+        tag == PostgresTypeTag::NUMERIC) {
       auto widthScale = getDecimalWidthScale(str);
       if (widthScale) {
         auto [width, scale] = *widthScale;
@@ -133,6 +137,20 @@ public:
     }
   }
 
+  /**
+   * A STRUCT with the given named fields (e.g. to return several values)
+   */
+  static Type makeStruct(const Vec<Pair<String, Type>> &fields) {
+    Type type(false, std::nullopt, std::nullopt, PostgresTypeTag::RECORD,
+              "RECORD");
+    for (auto &[name, fieldType] : fields) {
+      type.fieldNames.push_back(name);
+      type.fieldTypes.push_back(fieldType);
+    }
+    type.typeString = type.getDuckDBType();
+    return type;
+  }
+
   static Opt<int> getWidth(bool decimal, Opt<int> width) {
     if (decimal) {
       if (!width) {
@@ -212,6 +230,15 @@ public:
   }
 
   String getDuckDBLogicalTypeStr() const {
+    if (isStruct()) {
+      Vec<String> children;
+      for (auto &[name, fieldType] : getFields()) {
+        children.push_back(fmt::format("{{\"{}\", {}}}", name,
+                                       fieldType.getDuckDBLogicalTypeStr()));
+      }
+      return fmt::format("LogicalType::STRUCT({{{}}})",
+                         joinVector(children, ", "));
+    }
     return "LogicalType::" + getDuckDBType();
   }
 
@@ -221,6 +248,15 @@ public:
   bool isNumeric() const { return NumericTypes.count(duckdbTag); }
   bool isBoolean() const { return duckdbTag == DuckdbTypeTag::BOOLEAN; }
   bool isBlob() const { return BlobTypes.count(duckdbTag); }
+  bool isStruct() const { return duckdbTag == DuckdbTypeTag::STRUCT; }
+
+  Vec<Pair<String, Type>> getFields() const {
+    Vec<Pair<String, Type>> fields;
+    for (std::size_t i = 0; i < fieldNames.size(); ++i) {
+      fields.emplace_back(fieldNames[i], fieldTypes[i]);
+    }
+    return fields;
+  }
 
 protected:
   void print(std::ostream &os) const;
@@ -235,4 +271,7 @@ protected:
   DuckdbTypeTag duckdbTag;
   CppTypeTag cppTag;
   String typeString;
+  // the fields of a STRUCT
+  Vec<String> fieldNames;
+  Vec<Type> fieldTypes;
 };
@@ -137,61 +137,23 @@ String toLower(const String &str);
 String toUpper(const String &str);
 String removeSpaces(const String &str);
 
+/**
+ * The position and length of every unqualified identifier of the SQL text,
+ * string literals and quoted identifiers are skipped
+ */
+Vec<Pair<std::size_t, std::size_t>> findIdentifiers(const String &text);
+
+/**
+ * Replaces the identifiers of the SQL text that are keys of values (in lower
+ * case) by their bracketed values in a single pass, so the values themselves
+ * are not rewritten
+ */
+String substituteIdentifiers(const String &text,
+                             const Map<String, String> &values);
+
 Vec<String> extractMatches(const String &str, const char *pattern,
                            std::size_t group = 1);
 
-static Map<String, String> alias_to_duckdb_type = {{"UNKNOWN", "UNKNOWN"},
-                                                   {"BIGINT", "BIGINT"},
-                                                   {"INT8", "BIGINT"},
-                                                   {"LONG", "BIGINT"},
-                                                   {"BIT", "BIT"},
-                                                   {"BITSTRING", "BIT"},
-                                                   {"BOOLEAN", "BOOLEAN"},
-                                                   {"BOOL", "BOOLEAN"},
-                                                   {"LOGICAL", "BOOLEAN"},
-                                                   {"BLOB", "BLOB"},
-                                                   {"BYTEA", "BLOB"},
-                                                   {"BINARY", "BLOB"},
-                                                   {"VARBINARY", "BLOB"},
-                                                   {"DATE", "DATE"},
-                                                   {"DOUBLE", "DOUBLE"},
-                                                   {"FLOAT8", "DOUBLE"},
-                                                   {"NUMERIC", "DOUBLE"},
-                                                   {"DECIMAL", "DOUBLE"},
-                                                   {"HUGEINT", "HUGEINT"},
-                                                   {"INTEGER", "INTEGER"},
-                                                   {"INT", "INTEGER"},
-                                                   {"INT4", "INTEGER"},
-                                                   {"SIGNED", "INTEGER"},
-                                                   {"INTERVAL", "INTERVAL"},
-                                                   {"REAL", "REAL"},
-                                                   {"FLOAT4", "REAL"},
-                                                   {"FLOAT", "REAL"},
-                                                   {"SMALLINT", "SMALLINT"},
-                                                   {"INT2", "SMALLINT"},
-                                                   {"SHORT", "SMALLINT"},
-                                                   {"TIME", "TIME"},
-                                                   {"TIMESTAMP", "TIMESTAMP"},
-                                                   {"DATETIME", "TIMESTAMP"},
-                                                   {"TINYINT", "TINYINT"},
-                                                   {"INT1", "TINYINT"},
-                                                   {"UBIGINT", "UBIGINT"},
-                                                   {"UINTEGER", "UINTEGER"},
-                                                   {"USMALLINT", "USMALLINT"},
-                                                   {"UTINYINT", "UTINYINT"},
-                                                   {"UUID", "UUID"},
-                                                   {"VARCHAR", "VARCHAR"},
-                                                   {"CHAR", "VARCHAR"},
-                                                   {"BPCHAR", "VARCHAR"},
-                                                   {"TEXT", "VARCHAR"},
-                                                   {"STRING", "VARCHAR"}};
-static Map<String, String> duckdb_to_cpp_type = {
-    {"BOOLEAN", "bool"},   {"TINYINT", "int8_t"},    {"SMALLINT", "int16_t"},
-    {"DATE", "date_t"},    {"TIME", "int32_t"},      {"INTEGER", "int32_t"},
-    {"BIGINT", "int64_t"}, {"TIMESTAMP", "int64_t"}, {"FLOAT", "float"},
-    {"DOUBLE", "double"},  {"DECIMAL", "double"},    {"VARCHAR", "string_t"},
-    {"CHAR", "string_t"},  {"BLOB", "string_t"}};
-
 class YAMLConfig {
 public:
   YAML::Node query;
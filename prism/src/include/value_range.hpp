@@ -0,0 +1,122 @@
+#pragma once
+
+#include "utils.hpp"
+#include <limits>
+
+/**
+ * A closed interval [lower, upper] of integer values
+ */
+class ValueRange {
+public:
+  ValueRange(int64_t lower, int64_t upper) : lower(lower), upper(upper) {}
+
+  static ValueRange top() {
+    return ValueRange(std::numeric_limits<int64_t>::min(),
+                      std::numeric_limits<int64_t>::max());
+  }
+
+  /**
+   * The range of a C++ integer type, std::nullopt for non-integer types
+   */
+  static Opt<ValueRange> ofCppType(const String &cppType) {
+    if (cppType == "int8_t") {
+      return ValueRange(INT8_MIN, INT8_MAX);
+    } else if (cppType == "int16_t") {
+      return ValueRange(INT16_MIN, INT16_MAX);
+    } else if (cppType == "int32_t") {
+      return ValueRange(INT32_MIN, INT32_MAX);
+    } else if (cppType == "int64_t") {
+      return top();
+    } else if (cppType == "uint8_t") {
+      return ValueRange(0, UINT8_MAX);
+    } else if (cppType == "uint16_t") {
+      return ValueRange(0, UINT16_MAX);
+    } else if (cppType == "uint32_t") {
+      return ValueRange(0, UINT32_MAX);
+    }
+    return std::nullopt;
+  }
+
+  /**
+   * The narrowest signed C++ integer type holding every value of the range
+   */
+  String narrowestCppType() const {
+    for (const auto *type : {"int8_t", "int16_t", "int32_t"}) {
+      if (fitsIn(*ofCppType(type))) {
+        return type;
+      }
+    }
+    return "int64_t";
+  }
+
+  int64_t getLower() const { return lower; }
+  int64_t getUpper() const { return upper; }
+
+  bool fitsIn(const ValueRange &other) const {
+    return other.lower <= lower && upper <= other.upper;
+  }
+
+  bool operator==(const ValueRange &other) const {
+    return lower == other.lower && upper == other.upper;
+  }
+  bool operator!=(const ValueRange &other) const { return !(*this == other); }
+
+  ValueRange join(const ValueRange &other) const {
+    return ValueRange(std::min(lower, other.lower),
+                      std::max(upper, other.upper));
+  }
+
+  /**
+   * std::nullopt if the ranges do not overlap, i.e. the code is unreachable
+   */
+  Opt<ValueRange> intersect(const ValueRange &other) const {
+    auto newLower = std::max(lower, other.lower);
+    auto newUpper = std::min(upper, other.upper);
+    if (newLower > newUpper) {
+      return std::nullopt;
+    }
+    return ValueRange(newLower, newUpper);
+  }
+
+  // the arithmetic saturates to top whenever a bound overflows int64_t
+  ValueRange add(const ValueRange &other) const {
+    int64_t newLower, newUpper;
+    if (__builtin_add_overflow(lower, other.lower, &newLower) ||
+        __builtin_add_overflow(upper, other.upper, &newUpper)) {
+      return top();
+    }
+    return ValueRange(newLower, newUpper);
+  }
+
+  ValueRange subtract(const ValueRange &other) const {
+    int64_t newLower, newUpper;
+    if (__builtin_sub_overflow(lower, other.upper, &newLower) ||
+        __builtin_sub_overflow(upper, other.lower, &newUpper)) {
+      return top();
+    }
+    return ValueRange(newLower, newUpper);
+  }
+
+  ValueRange multiply(const ValueRange &other) const {
+    int64_t products[4];
+    if (__builtin_mul_overflow(lower, other.lower, &products[0]) ||
+        __builtin_mul_overflow(lower, other.upper, &products[1]) ||
+        __builtin_mul_overflow(upper, other.lower, &products[2]) ||
+        __builtin_mul_overflow(upper, other.upper, &products[3])) {
+      return top();
+    }
+    return ValueRange(*std::min_element(products, products + 4),
+                      *std::max_element(products, products + 4));
+  }
+
+  ValueRange negate() const { return ValueRange(0, 0).subtract(*this); }
+
+  friend std::ostream &operator<<(std::ostream &os, const ValueRange &range) {
+    os << "[" << range.lower << ", " << range.upper << "]";
+    return os;
+  }
+
+private:
+  int64_t lower;
+  int64_t upper;
+};
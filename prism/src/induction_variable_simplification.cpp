@@ -0,0 +1,507 @@
+#include "induction_variable_simplification.hpp"
+#include "duckdb/planner/expression/bound_cast_expression.hpp"
+#include "duckdb/planner/expression/bound_comparison_expression.hpp"
+#include "duckdb/planner/expression/bound_constant_expression.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "duckdb/planner/expression_iterator.hpp"
+#include "instructions.hpp"
+#include "loop_invariant_code_motion.hpp"
+#include "range_analysis.hpp"
+
+using Affine = InductionVariableSimplificationPass::Affine;
+using duckdb::BoundCastExpression;
+using duckdb::BoundComparisonExpression;
+using duckdb::BoundConstantExpression;
+using duckdb::BoundFunctionExpression;
+using duckdb::Expression;
+using duckdb::ExpressionClass;
+using duckdb::ExpressionType;
+
+static bool isIntegral(const duckdb::LogicalType &type) {
+  return RangeAnalysis::getTypeRange(type).has_value();
+}
+
+static String constantText(int64_t value) {
+  return fmt::format("CAST({} AS HUGEINT)", value);
+}
+
+/**
+ * Combine two parts of an affine expression, folding known constants
+ */
+static std::pair<String, Opt<int64_t>>
+combine(char op, const String &left, Opt<int64_t> leftConstant,
+        const String &right, Opt<int64_t> rightConstant) {
+  if (leftConstant && rightConstant) {
+    int64_t result;
+    bool overflow =
+        op == '+' ? __builtin_add_overflow(*leftConstant, *rightConstant,
+                                           &result)
+        : op == '-'
+            ? __builtin_sub_overflow(*leftConstant, *rightConstant, &result)
+            : __builtin_mul_overflow(*leftConstant, *rightConstant, &result);
+    if (!overflow) {
+      return {constantText(result), result};
+    }
+  }
+  if ((op == '+' || op == '-') && rightConstant == 0) {
+    return {left, leftConstant};
+  } else if (op == '+' && leftConstant == 0) {
+    return {right, rightConstant};
+  } else if (op == '*' && rightConstant == 1) {
+    return {left, leftConstant};
+  } else if (op == '*' && leftConstant == 1) {
+    return {right, rightConstant};
+  }
+  return {fmt::format("({} {} {})", left, op, right), std::nullopt};
+}
+
+static Affine makeAffine(const std::pair<String, Opt<int64_t>> &coefficient,
+                         const std::pair<String, Opt<int64_t>> &offset) {
+  return {coefficient.first, offset.first, coefficient.second, offset.second};
+}
+
+static Affine constantAffine(int64_t value) {
+  return {constantText(0), constantText(value), 0, value};
+}
+
+static Affine addAffine(char op, const Affine &left, const Affine &right) {
+  return makeAffine(combine(op, left.coefficient, left.constantCoefficient,
+                            right.coefficient, right.constantCoefficient),
+                    combine(op, left.offset, left.constantOffset, right.offset,
+                            right.constantOffset));
+}
+
+static Opt<Affine> multiplyAffine(const Affine &left, const Affine &right) {
+  // one side must be invariant for the product to stay affine
+  if (left.constantCoefficient == 0) {
+    return makeAffine(combine('*', left.offset, left.constantOffset,
+                              right.coefficient, right.constantCoefficient),
+                      combine('*', left.offset, left.constantOffset,
+                              right.offset, right.constantOffset));
+  } else if (right.constantCoefficient == 0) {
+    return multiplyAffine(right, left);
+  }
+  return std::nullopt;
+}
+
+static const Expression &stripIntegralCasts(const Expression &expr) {
+  if (expr.GetExpressionClass() == ExpressionClass::BOUND_CAST) {
+    auto &cast = expr.Cast<BoundCastExpression>();
+    if (isIntegral(cast.child->return_type) && isIntegral(cast.return_type)) {
+      return stripIntegralCasts(*cast.child);
+    }
+  }
+  return expr;
+}
+
+static const Variable *getReferencedVariable(Function &f,
+                                             const Expression &expr) {
+  auto &stripped = stripIntegralCasts(expr);
+  if (stripped.GetExpressionClass() != ExpressionClass::BOUND_COLUMN_REF &&
+      stripped.GetExpressionClass() != ExpressionClass::BOUND_REF) {
+    return nullptr;
+  }
+  auto name = toLower(stripped.GetName());
+  return f.hasBinding(name) ? f.getBinding(name) : nullptr;
+}
+
+static Opt<int64_t> getConstant(const Expression &expr) {
+  auto &stripped = stripIntegralCasts(expr);
+  if (stripped.GetExpressionClass() != ExpressionClass::BOUND_CONSTANT) {
+    return std::nullopt;
+  }
+  auto &value = stripped.Cast<BoundConstantExpression>().value;
+  if (value.IsNull()) {
+    return std::nullopt;
+  }
+  return value.GetValue<int64_t>();
+}
+
+/**
+ * Whether all the arithmetic of the expression is done in types at least as
+ * wide as the given one
+ */
+static bool isComputedIn(const Expression &expr,
+                         const duckdb::LogicalType &type) {
+  bool wide = true;
+  if (expr.GetExpressionClass() == ExpressionClass::BOUND_FUNCTION) {
+    auto range = RangeAnalysis::getTypeRange(expr.return_type);
+    wide = range && RangeAnalysis::getTypeRange(type)->fitsIn(*range);
+  }
+  duckdb::ExpressionIterator::EnumerateChildren(
+      expr, [&](const Expression &child) {
+        wide = wide && isComputedIn(child, type);
+      });
+  return wide;
+}
+
+Opt<Affine>
+InductionVariableSimplificationPass::getAffine(Function &f,
+                                               const Expression &expr,
+                                               const LoopInfo &info) const {
+  if (!isIntegral(expr.return_type)) {
+    return std::nullopt;
+  }
+  switch (expr.GetExpressionClass()) {
+  case ExpressionClass::BOUND_CONSTANT: {
+    auto &constant = expr.Cast<BoundConstantExpression>();
+    if (constant.value.IsNull()) {
+      return std::nullopt;
+    }
+    return constantAffine(constant.value.GetValue<int64_t>());
+  }
+  case ExpressionClass::BOUND_COLUMN_REF:
+  case ExpressionClass::BOUND_REF: {
+    auto *var = getReferencedVariable(f, expr);
+    if (var == nullptr) {
+      return std::nullopt;
+    }
+    if (var == info.inductionVariable) {
+      return Affine{constantText(1), constantText(0), 1, 0};
+    }
+    if (info.definitions.find(var) != info.definitions.end()) {
+      return getAffine(f, *info.definitions.at(var), info);
+    }
+    for (auto *block : info.blocks) {
+      for (auto &inst : *block) {
+        if (inst.getResultOperand() == var) {
+          return std::nullopt;
+        }
+      }
+    }
+    // defined outside of the loop
+    return Affine{constantText(0),
+                  fmt::format("CAST({} AS HUGEINT)", var->getName()), 0,
+                  std::nullopt};
+  }
+  case ExpressionClass::BOUND_CAST: {
+    auto &stripped = stripIntegralCasts(expr);
+    if (&stripped == &expr) {
+      return std::nullopt;
+    }
+    return getAffine(f, stripped, info);
+  }
+  case ExpressionClass::BOUND_FUNCTION: {
+    auto &function = expr.Cast<BoundFunctionExpression>();
+    auto &name = function.function.name;
+    Vec<Affine> args;
+    for (auto &child : function.children) {
+      auto arg = getAffine(f, *child, info);
+      if (!arg) {
+        return std::nullopt;
+      }
+      args.push_back(*arg);
+    }
+    if (name == "+" && args.size() == 2) {
+      return addAffine('+', args[0], args[1]);
+    } else if (name == "-" && args.size() == 2) {
+      return addAffine('-', args[0], args[1]);
+    } else if (name == "-" && args.size() == 1) {
+      return addAffine('-', constantAffine(0), args[0]);
+    } else if (name == "*" && args.size() == 2) {
+      return multiplyAffine(args[0], args[1]);
+    }
+    return std::nullopt;
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+/**
+ * The t such that expr = var + t, following the definitions of the loop body
+ */
+Opt<Affine> InductionVariableSimplificationPass::getIncrement(
+    Function &f, const Expression &expr, const Variable *var,
+    const LoopInfo &info) const {
+  auto &stripped = stripIntegralCasts(expr);
+  auto *referenced = getReferencedVariable(f, stripped);
+  if (referenced != nullptr &&
+      info.definitions.find(referenced) != info.definitions.end()) {
+    return getIncrement(f, *info.definitions.at(referenced), var, info);
+  }
+  if (stripped.GetExpressionClass() != ExpressionClass::BOUND_FUNCTION) {
+    return std::nullopt;
+  }
+  auto &function = stripped.Cast<BoundFunctionExpression>();
+  auto &name = function.function.name;
+  if (function.children.size() != 2) {
+    return std::nullopt;
+  }
+  auto &left = *function.children[0];
+  auto &right = *function.children[1];
+  if (name == "+" && getReferencedVariable(f, left) == var) {
+    return getAffine(f, right, info);
+  } else if (name == "+" && getReferencedVariable(f, right) == var) {
+    return getAffine(f, left, info);
+  } else if (name == "-" && getReferencedVariable(f, left) == var) {
+    auto decrement = getAffine(f, right, info);
+    if (decrement) {
+      return addAffine('-', constantAffine(0), *decrement);
+    }
+  }
+  return std::nullopt;
+}
+
+/**
+ * Recognizes a loop of the shape produced for FOR and WHILE loops:
+ *   header: phi nodes, jmp exiting
+ *   exiting: br <iv> <cmp> <bound> [body, exit]
+ *   body: straight-line pure assignments ending in a jmp to the header
+ */
+bool InductionVariableSimplificationPass::simplifyLoop(Function &f,
+                                                       LoopRegion *loop) {
+  if (!loop->getMetadata().is_null()) {
+    return false;
+  }
+  auto *header = loop->getHeader();
+  auto loopBlocks = loop->getBasicBlocks();
+  LoopInfo info;
+  info.blocks = Set<BasicBlock *>(loopBlocks.begin(), loopBlocks.end());
+  info.inductionVariable = nullptr;
+
+  auto *preheader = LoopInvariantCodeMotionPass::getPreheader(f, loop);
+  if (preheader == nullptr || preheader == f.getEntryBlock() ||
+      header->getPredecessors().size() != 2) {
+    return false;
+  }
+  auto &headerPreds = header->getPredecessors();
+  auto *latch = headerPreds[0] == preheader ? headerPreds[1] : headerPreds[0];
+
+  // the header only holds phi nodes
+  Vec<const PhiNode *> phis;
+  for (auto &inst : *header) {
+    if (auto *phi = dynamic_cast<const PhiNode *>(&inst)) {
+      phis.push_back(phi);
+    } else if (&inst != header->getTerminator()) {
+      return false;
+    }
+  }
+  auto *headerBranch = dynamic_cast<BranchInst *>(header->getTerminator());
+  if (headerBranch == nullptr || headerBranch->isConditional()) {
+    return false;
+  }
+
+  // the exiting block only tests the condition, the body is on the true edge
+  auto *exiting = headerBranch->getIfTrue();
+  auto *exitBranch = dynamic_cast<BranchInst *>(exiting->getTerminator());
+  if (exiting == header || info.blocks.count(exiting) == 0 ||
+      exitBranch == nullptr || !exitBranch->isConditional() ||
+      &*exiting->begin() != exiting->getTerminator() ||
+      info.blocks.count(exitBranch->getIfTrue()) == 0 ||
+      info.blocks.count(exitBranch->getIfFalse()) > 0 ||
+      exitBranch->getCond()->isSQLExpression()) {
+    return false;
+  }
+  auto *exit = exitBranch->getIfFalse();
+
+  // the values the phi nodes take on the next iteration
+  Set<const Variable *> phiInputs;
+  for (auto *phi : phis) {
+    auto &next = *phi->getRHS()[header->getPredNumber(latch)];
+    if (next.isPure()) {
+      phiInputs.insert(
+          getReferencedVariable(f, *next.getLogicalPlan()->expressions[0]));
+    }
+  }
+
+  // the body is straight-line code without queries, the other definitions
+  // are removed with the loop so they must not be able to raise an error
+  for (auto *block : loopBlocks) {
+    if (block == header || block == exiting) {
+      continue;
+    }
+    auto *branch = dynamic_cast<BranchInst *>(block->getTerminator());
+    if (branch == nullptr || branch->isConditional()) {
+      return false;
+    }
+    for (auto &inst : *block) {
+      if (&inst == block->getTerminator()) {
+        continue;
+      }
+      auto *assign = dynamic_cast<const Assignment *>(&inst);
+      if (assign == nullptr || !assign->getRHS()->isPure() ||
+          (phiInputs.count(assign->getLHS()) == 0 &&
+           !LoopInvariantCodeMotionPass::canSpeculate(assign->getRHS()))) {
+        return false;
+      }
+      info.definitions.insert(
+          {assign->getLHS(),
+           assign->getRHS()->getLogicalPlan()->expressions[0].get()});
+    }
+  }
+
+  // the condition compares the induction variable with an invariant bound
+  auto &condExpr = *exitBranch->getCond()->getLogicalPlan()->expressions[0];
+  if (condExpr.GetExpressionClass() != ExpressionClass::BOUND_COMPARISON) {
+    return false;
+  }
+  auto &comparison = condExpr.Cast<BoundComparisonExpression>();
+  auto comparisonType = comparison.GetExpressionType();
+  const PhiNode *inductionPhi = nullptr;
+  const Expression *boundExpr = nullptr;
+  for (auto *phi : phis) {
+    if (getReferencedVariable(f, *comparison.left) == phi->getLHS()) {
+      inductionPhi = phi;
+      boundExpr = comparison.right.get();
+    } else if (getReferencedVariable(f, *comparison.right) == phi->getLHS()) {
+      inductionPhi = phi;
+      boundExpr = comparison.left.get();
+      comparisonType = duckdb::FlipComparisonExpression(comparisonType);
+    }
+  }
+  if (inductionPhi == nullptr) {
+    return false;
+  }
+  info.inductionVariable = inductionPhi->getLHS();
+  auto bound = getAffine(f, *boundExpr, info);
+  if (!bound || bound->constantCoefficient != 0) {
+    return false;
+  }
+
+  auto getInit = [&](const PhiNode *phi) {
+    return fmt::format("CAST(({}) AS HUGEINT)",
+                       phi->getRHS()[header->getPredNumber(preheader)]
+                           ->getRawSQL());
+  };
+  auto getNext = [&](const PhiNode *phi) -> const Expression & {
+    return *phi->getRHS()[header->getPredNumber(latch)]
+                ->getLogicalPlan()
+                ->expressions[0];
+  };
+  auto getConstantInit = [&](const PhiNode *phi) {
+    return getConstant(*phi->getRHS()[header->getPredNumber(preheader)]
+                            ->getLogicalPlan()
+                            ->expressions[0]);
+  };
+
+  // the induction variable moves by a constant step towards the bound
+  auto step = getIncrement(f, getNext(inductionPhi), info.inductionVariable,
+                           info);
+  if (!step || step->constantCoefficient != 0 || !step->constantOffset ||
+      *step->constantOffset == 0) {
+    return false;
+  }
+  auto stepValue = *step->constantOffset;
+  auto init = getInit(inductionPhi);
+  String tripCount;
+  if (comparisonType == ExpressionType::COMPARE_LESSTHAN && stepValue > 0) {
+    tripCount = fmt::format("GREATEST(({} - {} + {}) // {}, 0)",
+                            bound->offset, init, stepValue - 1, stepValue);
+  } else if (comparisonType == ExpressionType::COMPARE_LESSTHANOREQUALTO &&
+             stepValue > 0) {
+    tripCount = fmt::format("GREATEST(({} - {} + {}) // {}, 0)",
+                            bound->offset, init, stepValue, stepValue);
+  } else if (comparisonType == ExpressionType::COMPARE_GREATERTHAN &&
+             stepValue < 0) {
+    tripCount = fmt::format("GREATEST(({} - {} + {}) // {}, 0)", init,
+                            bound->offset, -stepValue - 1, -stepValue);
+  } else if (comparisonType == ExpressionType::COMPARE_GREATERTHANOREQUALTO &&
+             stepValue < 0) {
+    tripCount = fmt::format("GREATEST(({} - {} + {}) // {}, 0)", init,
+                            bound->offset, -stepValue, -stepValue);
+  } else {
+    return false;
+  }
+
+  // the value of every phi node once the loop exits, computed over HUGEINT
+  // the values of the iterations must lie between the initial and the final
+  // one, so that the final cast raises the error an iteration would
+  Map<const PhiNode *, String> finalValues;
+  auto inductionInit = getConstantInit(inductionPhi);
+  for (auto *phi : phis) {
+    if (!isIntegral(phi->getLHS()->getType().getDuckDBLogicalType())) {
+      return false;
+    }
+    if (phi == inductionPhi) {
+      finalValues.insert(
+          {phi, fmt::format("({} + {} * {})", init, tripCount, stepValue)});
+      continue;
+    }
+    // sum over the iterations of coefficient * iv + offset
+    auto increment = getIncrement(f, getNext(phi), phi->getLHS(), info);
+    if (!increment || !increment->constantCoefficient ||
+        !increment->constantOffset) {
+      return false;
+    }
+    // an increment that depends on the induction variable moves the sum in
+    // one direction only when all its parts have the same sign, and it is
+    // bounded by the sum when computed in a type as wide as the sum
+    if (*increment->constantCoefficient != 0) {
+      auto *next = &getNext(phi);
+      auto *nextVar = getReferencedVariable(f, *next);
+      if (nextVar != nullptr &&
+          info.definitions.find(nextVar) != info.definitions.end()) {
+        next = info.definitions.at(nextVar);
+      }
+      auto sumInit = getConstantInit(phi);
+      auto sumType = phi->getLHS()->getType().getDuckDBLogicalType();
+      if (!inductionInit || !sumInit || !isComputedIn(*next, sumType)) {
+        return false;
+      }
+      Vec<__int128> parts = {
+          *sumInit, *increment->constantOffset,
+          (__int128)*increment->constantCoefficient * *inductionInit,
+          (__int128)*increment->constantCoefficient * stepValue};
+      bool nonNegative = std::all_of(parts.begin(), parts.end(),
+                                     [](__int128 part) { return part >= 0; });
+      bool nonPositive = std::all_of(parts.begin(), parts.end(),
+                                     [](__int128 part) { return part <= 0; });
+      if (!nonNegative && !nonPositive) {
+        return false;
+      }
+    }
+    // the initial value is kept as is when the loop body never runs
+    finalValues.insert(
+        {phi, fmt::format("(CASE WHEN {} > 0 THEN {} + {} * ({} * {} + {}) + "
+                          "{} * {} * ({} * ({} - 1) // 2) ELSE {} END)",
+                          tripCount, getInit(phi), tripCount,
+                          increment->coefficient, init, increment->offset,
+                          increment->coefficient, stepValue, tripCount,
+                          tripCount, getInit(phi))});
+  }
+
+  // the header computes the final values and jumps to the exit
+  for (auto it = header->begin(); it != header->end(); ++it) {
+    auto *phi = dynamic_cast<const PhiNode *>(&*it);
+    if (phi == nullptr) {
+      continue;
+    }
+    auto &type = phi->getLHS()->getType();
+    auto closedForm = f.bindExpression(
+        fmt::format("CAST({} AS {})", finalValues.at(phi),
+                    type.getDuckDBType()),
+        type);
+    it = header->replaceInst(
+        it, Make<Assignment>(phi->getLHS(), std::move(closedForm)));
+  }
+  exit->replacePredecessor(exiting, header);
+  header->getTerminator()->replaceWith(Make<BranchInst>(exit), true);
+
+  for (auto *block : loopBlocks) {
+    if (block == header) {
+      continue;
+    }
+    for (auto it = block->begin(); it != block->end();) {
+      it = block->removeInst(it);
+    }
+  }
+  for (auto *block : loopBlocks) {
+    if (block != header) {
+      f.removeBasicBlock(block);
+    }
+  }
+  loop->getParentRegion()->replaceNestedRegion(
+      loop, Make<LeafRegion>(header).release());
+  return true;
+}
+
+bool InductionVariableSimplificationPass::runOnFunction(Function &f) {
+  bool changed = false;
+  // inner loops come first, once they are gone the enclosing loop may become
+  // simple enough as well
+  for (auto *loop : LoopInvariantCodeMotionPass::getLoops(f)) {
+    changed = simplifyLoop(f, loop) || changed;
+  }
+  return changed;
+}
@@ -0,0 +1,357 @@
+#include "inlining.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "duckdb/planner/expression_iterator.hpp"
+#include "instructions.hpp"
+
+using duckdb::ExpressionClass;
+
+static const SelectExpression *getExpression(const Instruction &inst) {
+  if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+    return assign->getRHS();
+  } else if (auto *ret = dynamic_cast<const ReturnInst *>(&inst)) {
+    return ret->getExpr();
+  } else if (auto *branch = dynamic_cast<const BranchInst *>(&inst)) {
+    return branch->isConditional() ? branch->getCond() : nullptr;
+  }
+  return nullptr;
+}
+
+static Own<Instruction> withExpression(const Instruction &inst,
+                                       Own<SelectExpression> expr) {
+  if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+    return Make<Assignment>(assign->getLHS(), std::move(expr));
+  } else if (dynamic_cast<const ReturnInst *>(&inst)) {
+    return Make<ReturnInst>(std::move(expr));
+  }
+  auto *branch = dynamic_cast<const BranchInst *>(&inst);
+  return Make<BranchInst>(branch->getIfTrue(), branch->getIfFalse(),
+                          std::move(expr));
+}
+
+/**
+ * The positions of the name and of the opening parenthesis of every call to
+ * the function in the SQL text
+ */
+static Vec<Pair<std::size_t, std::size_t>> findCalls(const String &text,
+                                                     const String &name) {
+  Vec<Pair<std::size_t, std::size_t>> calls;
+  for (auto &[start, length] : findIdentifiers(text)) {
+    auto paren = text.find_first_not_of(" \t\n", start + length);
+    if (toLower(text.substr(start, length)) == toLower(name) &&
+        paren != String::npos && text[paren] == '(') {
+      calls.push_back({start, paren});
+    }
+  }
+  return calls;
+}
+
+/**
+ * Whether every call to the function is evaluated whenever the expression is,
+ * calls under a CASE, AND/OR or COALESCE can't be moved out of it
+ */
+static bool isCalledUnconditionally(const duckdb::Expression &expr,
+                                    const String &name, bool conditional,
+                                    std::size_t &calls) {
+  if (expr.GetExpressionClass() == ExpressionClass::BOUND_FUNCTION &&
+      toLower(expr.Cast<duckdb::BoundFunctionExpression>().function.name) ==
+          name) {
+    if (conditional) {
+      return false;
+    }
+    ++calls;
+  }
+  conditional =
+      conditional || expr.GetExpressionClass() == ExpressionClass::BOUND_CASE ||
+      expr.GetExpressionClass() == ExpressionClass::BOUND_CONJUNCTION ||
+      expr.GetExpressionType() == duckdb::ExpressionType::OPERATOR_COALESCE;
+  bool unconditional = true;
+  duckdb::ExpressionIterator::EnumerateChildren(
+      expr, [&](const duckdb::Expression &child) {
+        unconditional =
+            unconditional &&
+            isCalledUnconditionally(child, name, conditional, calls);
+      });
+  return unconditional;
+}
+
+bool InliningPass::calls(Function &f, const String &name) {
+  for (auto &block : f) {
+    for (auto &inst : block) {
+      auto *expr = getExpression(inst);
+      if (expr != nullptr && !findCalls(expr->getRawSQL(), name).empty()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+Vec<Function *>
+InliningPass::getCallees(Function &f, const Map<String, Function *> &udfs) {
+  Vec<Function *> callees;
+  for (auto &[name, callee] : udfs) {
+    if (calls(f, name)) {
+      callees.push_back(callee);
+    }
+  }
+  std::sort(callees.begin(), callees.end(), [](Function *a, Function *b) {
+    return a->getFunctionName() < b->getFunctionName();
+  });
+  return callees;
+}
+
+Vec<Function *>
+InliningPass::getBottomUpOrder(const Vec<Function *> &functions,
+                               const Map<String, Function *> &udfs) {
+  Vec<Function *> order;
+  Set<Function *> visited;
+  std::function<void(Function *)> visit = [&](Function *f) {
+    if (!visited.insert(f).second) {
+      return;
+    }
+    for (auto *callee : getCallees(*f, udfs)) {
+      visit(callee);
+    }
+    order.push_back(f);
+  };
+  for (auto *f : functions) {
+    visit(f);
+  }
+  return order;
+}
+
+/**
+ * Only callees of at most MAX_CALLEE_SIZE assignments, returns and branches
+ * with a structured region tree are inlined. They must not call other UDFs,
+ * since callees are processed first this rejects recursive callees and those
+ * whose own callees could not be inlined
+ */
+bool InliningPass::canInline(Function &callee) const {
+  if (!getCallees(callee, udfs).empty()) {
+    return false;
+  }
+  for (auto &var : callee.getVariables()) {
+    // SSA and temporary names could clash with the renamed variables
+    if (var->getName().find("__") != String::npos) {
+      return false;
+    }
+  }
+  std::size_t size = 0;
+  for (auto &block : callee) {
+    for (auto &inst : block) {
+      if (!dynamic_cast<const Assignment *>(&inst) &&
+          !dynamic_cast<const ReturnInst *>(&inst) &&
+          !dynamic_cast<const BranchInst *>(&inst)) {
+        return false;
+      }
+      ++size;
+    }
+  }
+
+  // the region tree must be cloneable
+  std::function<bool(const Region *)> isStructured =
+      [&](const Region *region) {
+        if (dynamic_cast<const DummyRegion *>(region)) {
+          return false;
+        }
+        if (auto *recursiveRegion =
+                dynamic_cast<const RecursiveRegion *>(region)) {
+          for (auto *nested : recursiveRegion->getNestedRegions()) {
+            if (!isStructured(nested)) {
+              return false;
+            }
+          }
+        }
+        return true;
+      };
+  return size <= MAX_CALLEE_SIZE && callee.getRegion() != nullptr &&
+         isStructured(callee.getRegion());
+}
+
+/**
+ * The position and the arguments of the first call to the callee in the SQL
+ * text of the expression
+ */
+Opt<InliningPass::CallSite>
+InliningPass::findCallSite(const SelectExpression *expr,
+                           const Function &callee) const {
+  auto name = toLower(callee.getFunctionName());
+  std::size_t calls = 0;
+  if (expr->isSQLExpression() ||
+      !isCalledUnconditionally(*expr->getLogicalPlan()->expressions[0], name,
+                               false, calls) ||
+      calls == 0) {
+    return std::nullopt;
+  }
+
+  // the text must contain exactly the calls of the bound expression
+  auto text = expr->getRawSQL();
+  auto textCalls = findCalls(text, name);
+  if (textCalls.size() != calls) {
+    return std::nullopt;
+  }
+  CallSite callSite;
+  callSite.start = textCalls[0].first;
+
+  // split the arguments on the top-level commas
+  std::size_t depth = 1;
+  std::size_t argStart = textCalls[0].second + 1;
+  char quote = 0;
+  std::size_t i = argStart;
+  for (; i < text.size() && depth > 0; ++i) {
+    auto c = text[i];
+    if (quote != 0) {
+      quote = c == quote ? 0 : quote;
+      continue;
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      continue;
+    } else if (c == '(') {
+      ++depth;
+    } else if (c == ')') {
+      --depth;
+    }
+    if ((c == ',' && depth == 1) || depth == 0) {
+      callSite.args.push_back(text.substr(argStart, i - argStart));
+      argStart = i + 1;
+    }
+  }
+  if (depth > 0) {
+    return std::nullopt;
+  }
+  callSite.length = i - callSite.start;
+  if (callSite.args.size() == 1 &&
+      callSite.args[0].find_first_not_of(' ') == String::npos) {
+    callSite.args.clear();
+  }
+  if (callSite.args.size() != callee.getArguments().size()) {
+    return std::nullopt;
+  }
+  return callSite;
+}
+
+/**
+ * Splits the block before the call, evaluates the arguments into fresh
+ * variables and runs a copy of the callee whose returns store the result and
+ * jump back to the rest of the block:
+ *   prelude: <instructions before the call>, args = ..., jmp callee entry
+ *   <callee blocks>: return e becomes result = e, jmp block
+ *   block: <instruction with the call replaced by result>, ...
+ */
+bool InliningPass::inlineCall(Function &f, BasicBlock *block,
+                              Instruction *inst, const CallSite &callSite,
+                              Function &callee) {
+  auto *region = block->getRegion();
+  if (region == nullptr || region->getParentRegion() == nullptr ||
+      dynamic_cast<LoopRegion *>(region) || block == f.getEntryBlock()) {
+    return false;
+  }
+
+  // fresh variables for the arguments, locals and the result of the callee
+  Map<const Variable *, const Variable *> variableMap;
+  for (auto &arg : callee.getArguments()) {
+    variableMap.insert({arg.get(), f.createTempVariable(arg->getType(), true)});
+  }
+  for (auto &var : callee.getVariables()) {
+    variableMap.insert(
+        {var.get(), f.createTempVariable(var->getType(), var->isNull())});
+  }
+  auto *result = f.createTempVariable(callee.getReturnType(), true);
+
+  // the prelude takes over the predecessors and the code before the call
+  auto *prelude = f.makeBasicBlock();
+  auto preds = block->getPredecessors();
+  for (auto *pred : preds) {
+    pred->renameBasicBlock(block, prelude, block);
+  }
+  block->clearPredecessors();
+  for (auto it = block->begin(); &*it != inst;) {
+    prelude->addInstruction(it->clone());
+    it = block->removeInst(it);
+  }
+  for (std::size_t i = 0; i < callSite.args.size(); ++i) {
+    auto *arg = variableMap.at(callee.getArguments()[i].get());
+    prelude->addInstruction(Make<Assignment>(
+        arg, f.bindExpression(callSite.args[i], arg->getType())));
+  }
+
+  // copy the body of the callee
+  FunctionCloneAndRenameHelper cloneHelper;
+  for (auto &calleeBlock : callee) {
+    cloneHelper.basicBlockMap.insert({&calleeBlock, f.makeBasicBlock()});
+  }
+  auto getBlock = [&](BasicBlock *calleeBlock) {
+    return calleeBlock == nullptr ? nullptr
+                                  : cloneHelper.basicBlockMap.at(calleeBlock);
+  };
+  for (auto &calleeBlock : callee) {
+    auto *newBlock = cloneHelper.basicBlockMap.at(&calleeBlock);
+    for (auto &calleeInst : calleeBlock) {
+      if (auto *assign = dynamic_cast<const Assignment *>(&calleeInst)) {
+        newBlock->addInstruction(Make<Assignment>(
+            variableMap.at(assign->getLHS()),
+            f.renameVarInExpression(assign->getRHS(), variableMap)));
+      } else if (auto *ret = dynamic_cast<const ReturnInst *>(&calleeInst)) {
+        newBlock->addInstruction(Make<Assignment>(
+            result, f.renameVarInExpression(ret->getExpr(), variableMap)));
+        newBlock->addInstruction(Make<BranchInst>(block));
+      } else if (auto *branch = dynamic_cast<const BranchInst *>(&calleeInst)) {
+        newBlock->addInstruction(
+            branch->isConditional()
+                ? Make<BranchInst>(
+                      getBlock(branch->getIfTrue()),
+                      getBlock(branch->getIfFalse()),
+                      f.renameVarInExpression(branch->getCond(), variableMap))
+                : Make<BranchInst>(getBlock(branch->getIfTrue())));
+      }
+    }
+  }
+  prelude->addInstruction(Make<BranchInst>(getBlock(callee.getEntryBlock())));
+
+  // use the result in place of the call
+  auto *expr = getExpression(*inst);
+  auto text = expr->getRawSQL();
+  auto newText = text.substr(0, callSite.start) + "(" + result->getName() +
+                 ")" + text.substr(callSite.start + callSite.length);
+  block->replaceInst(
+      block->begin(),
+      withExpression(*inst, f.bindExpression(newText, expr->getReturnType())));
+
+  auto calleeRegion = cloneHelper.cloneAndRenameRegion(callee.getRegion());
+  region->getParentRegion()->wrapNestedRegion(
+      region, [&](Own<Region> rest) -> Own<Region> {
+        return Make<SequentialRegion>(prelude, std::move(calleeRegion),
+                                      std::move(rest));
+      });
+  return true;
+}
+
+bool InliningPass::runOnFunction(Function &f) {
+  bool changed = false;
+  for (auto *callee : getCallees(f, udfs)) {
+    if (callee == &f || !canInline(*callee)) {
+      continue;
+    }
+    bool inlined = true;
+    while (inlined) {
+      inlined = false;
+      for (auto &block : f) {
+        for (auto &inst : block) {
+          auto *expr = getExpression(inst);
+          auto callSite =
+              expr == nullptr ? std::nullopt : findCallSite(expr, *callee);
+          if (callSite && inlineCall(f, &block, &inst, *callSite, *callee)) {
+            inlined = true;
+            break;
+          }
+        }
+        // blocks were added, start over
+        if (inlined) {
+          break;
+        }
+      }
+      changed = changed || inlined;
+    }
+  }
+  return changed;
+}
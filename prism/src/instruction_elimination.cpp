@@ -42,6 +42,23 @@ bool InstructionEliminationPass::runOnFunction(Function &f) {
         continue;
       }
 
+      // copying an expensive expression into several uses recomputes it,
+      // keeping it is only better when GVN shares it between the uses
+      if (duckdb::optimizerPassOnMap.at("GlobalValueNumbering") == true &&
+          uses.size() > 1 && !assign->getRHS()->isTrivial()) {
+        continue;
+      }
+
+      // don't move a computation into a loop (LICM hoisted it out of there)
+      auto *defLoop = getEnclosingLoop(assign->getParent());
+      if (duckdb::optimizerPassOnMap.at("LoopInvariantCodeMotion") == true &&
+          !assign->getRHS()->isTrivial() &&
+          std::any_of(uses.begin(), uses.end(), [&](Instruction *use) {
+            return getEnclosingLoop(use->getParent()) != defLoop;
+          })) {
+        continue;
+      }
+
       // don't do propagation of SQL statements
       if (!aggressive && assign->getRHS()->isSQLExpression()) {
         continue;
@@ -1,5 +1,27 @@
 #include "instructions.hpp"
 #include "basic_block.hpp"
+#include "duckdb/planner/expression.hpp"
+
+bool SelectExpression::isTrivial() const {
+  if (isSQLExpression() || logicalPlan->expressions.empty()) {
+    return false;
+  }
+  switch (logicalPlan->expressions[0]->GetExpressionClass()) {
+  case duckdb::ExpressionClass::BOUND_CONSTANT:
+  case duckdb::ExpressionClass::BOUND_COLUMN_REF:
+  case duckdb::ExpressionClass::BOUND_REF:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool SelectExpression::isPure() const {
+  if (isSQLExpression() || logicalPlan->expressions.empty()) {
+    return false;
+  }
+  return !logicalPlan->expressions[0]->IsVolatile();
+}
 
 void BranchInst::print(std::ostream &os) const {
   if (conditional) {
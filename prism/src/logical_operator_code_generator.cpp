@@ -16,6 +16,7 @@
 #include "compiler_fmt/core.h"
 #include "duckdb/common/enums/expression_type.hpp"
 #include "function.hpp"
+#include "range_analysis.hpp"
 #include "utils.hpp"
 #include <iostream>
 
@@ -33,6 +34,31 @@ String pow10String(int scale_difference) {
   return ret;
 }
 
+/**
+ * check that input lies in (-limit, limit), in exception-free mode the error is
+ * recorded and input is zeroed so that the following cast cannot overflow
+ */
+String rangeCheck(const String &input, const String &limit,
+                  CodeGenInfo &insert) {
+  if (insert.exceptionFree) {
+    insert.mayFail = true;
+    return fmt::format("\
+      if ({input} >= {limit} || {input} <= -{limit}){{\n\
+        udf_error.SetError(\"Numeric value out of range\",\n\
+                           UDFErrorKind::CAST);\n\
+        {input} = 0;\n\
+      }}\
+      ",
+                       fmt::arg("input", input), fmt::arg("limit", limit));
+  }
+  return fmt::format("\
+      if ({input} >= {limit} || {input} <= -{limit}){{\n\
+        throw CastException(\"Numeric value out of range\");\n\
+      }}\
+      ",
+                     fmt::arg("input", input), fmt::arg("limit", limit));
+}
+
 void decimalDecimalCastHandler(const ScalarFunctionInfo &function_info,
                                String &function_name,
                                Vec<String> &template_args,
@@ -90,13 +116,7 @@ void decimalDecimalCastHandler(const ScalarFunctionInfo &function_info,
         // hugeint
         limit = "Hugeint::POWERS_OF_TEN[" + std::to_string(res_width) + "]";
       }
-      insert.lines.push_back(fmt::format("\
-      if ({input} >= {limit} || {input} <= -{limit}){{\n\
-        throw CastException(\"Numeric value out of range\");\n\
-      }}\
-      ",
-                                         fmt::arg("input", newVar),
-                                         fmt::arg("limit", limit)));
+      insert.lines.push_back(rangeCheck(newVar, limit, insert));
       if (source_physical != target_physical) {
         if (multiply_factor == "1" or multiply_factor == "hugeint_t(1)") {
           function_name = fmt::format("Cast::Operation");
@@ -114,23 +134,16 @@ void decimalDecimalCastHandler(const ScalarFunctionInfo &function_info,
       }
     }
   } else {
-    // scale down
-    // udf_todo: consider hugeint
+    // scale down, stays in fixed-point arithmetic and rounds like DuckDB
     auto scale_difference = source_scale - target_scale;
-    auto multiply_factor = pow10String(scale_difference);
+    auto divide_factor = pow10String(scale_difference);
+    if (scale_difference > 18) {
+      divide_factor =
+          "Hugeint::POWERS_OF_TEN[" + std::to_string(scale_difference) + "]";
+    }
     auto res_width = target_width + scale_difference;
-    if (source_width < res_width) {
-      // udf_todo: possibly a source of result difference
-      if (source_physical != target_physical) {
-        function_name =
-            fmt::format("1.0/{} * Cast::Operation", multiply_factor);
-        template_args.push_back(source_physical);
-        template_args.push_back(target_physical);
-      } else {
-        function_name = fmt::format("1.0/{} * ", multiply_factor);
-      }
-    } else {
-      // DecimalScaleUpCheckOperator
+    if (source_width >= res_width) {
+      // DecimalScaleDownCheckOperator
       // evaluate the child first
       String newVar = insert.newTmpVar();
       insert.lines.push_back(
@@ -138,25 +151,55 @@ void decimalDecimalCastHandler(const ScalarFunctionInfo &function_info,
       args.pop_front();
       args.push_front(newVar);
       String limit = pow10String(res_width);
-      insert.lines.push_back(fmt::format("\
-      if ({input} >= {limit} || {input} <= -{limit}){{\n\
-        throw CastException(\"Numeric value out of range\");\n\
-      }}\
-      ",
-                                         fmt::arg("input", newVar),
-                                         fmt::arg("limit", limit)));
-      if (source_physical != target_physical) {
-        function_name =
-            fmt::format("1.0/{} * Cast::Operation", multiply_factor);
-        template_args.push_back(source_physical);
-        template_args.push_back(target_physical);
-      } else {
-        function_name = fmt::format("1.0/{} * ", multiply_factor);
+      if (res_width > 18) {
+        // hugeint
+        limit = "Hugeint::POWERS_OF_TEN[" + std::to_string(res_width) + "]";
       }
+      insert.lines.push_back(rangeCheck(newVar, limit, insert));
     }
+    function_name = "DecimalScaleDown";
+    template_args.push_back(source_physical);
+    template_args.push_back(target_physical);
+    args.push_back(divide_factor);
   }
 }
 
+/**
+ * Replaces an operator that throws with its version that records the error in
+ * udf_error, for the exception-free mode
+ */
+void nonThrowingOperator(String &function_name, Vec<String> &template_args,
+                         CodeGenInfo &insert, List<String> &args) {
+  static const Vec<String> throwingOperators = {
+      "ToYearsOperator",        "ToHoursOperator",
+      "ToMinutesOperator",      "ToSecondsOperator",
+      "ToMilliSecondsOperator", "ArrayLengthBinaryOperator"};
+  const String overflowCheck = "OverflowCheck::";
+  auto pos = function_name.find(overflowCheck);
+  if (pos != String::npos) {
+    // e.g. AddOperatorOverflowCheck becomes a wrapper of TryAddOperator and
+    // DecimalAddOverflowCheck a wrapper of TryDecimalAdd
+    auto operation = function_name.substr(0, pos);
+    operation = operation.substr(operation.rfind(':') + 1);
+    function_name = "TryOverflowCheckWrapper::Operation";
+    template_args.insert(template_args.begin(), "Try" + operation);
+  } else if (function_name.find("NegateOperator::") != String::npos) {
+    function_name = "TryNegateOperator::Operation";
+  } else {
+    auto op = std::find_if(
+        throwingOperators.begin(), throwingOperators.end(),
+        [&](const String &name) {
+          return function_name.find(name + "::") != String::npos;
+        });
+    if (op == throwingOperators.end()) {
+      return;
+    }
+    function_name.insert(function_name.find(*op + "::"), "Try");
+  }
+  args.push_back("udf_error");
+  insert.mayFail = true;
+}
+
 /**
  *
  */
@@ -174,6 +217,11 @@ void BoundExpressionCodeGenerator::SpecialCaseHandler(
       function_name = "BinaryZeroIsNullWrapper::Operation";
       template_args.insert(template_args.begin(),
                            get_struct_name(function_info.cpp_name));
+      if (insert.exceptionFree) {
+        function_name = "TryBinaryZeroIsNullWrapper::Operation";
+        args.push_back("udf_error");
+        insert.mayFail = true;
+      }
       break;
     case ScalarFunctionInfo::BinaryZeroIsNullHugeintWrapper:
       // udf_todo
@@ -201,10 +249,20 @@ void BoundExpressionCodeGenerator::SpecialCaseHandler(
       template_args.push_back(get_struct_name(function_info.cpp_name));
       args.push_back(std::to_string(function_info.width_scale.first));
       args.push_back(std::to_string(function_info.width_scale.second));
+      if (insert.exceptionFree) {
+        function_name = "TryDecimalCastHelper";
+        args.push_back("udf_error");
+        insert.mayFail = true;
+      }
       break;
     case ScalarFunctionInfo::ErrorCastWrapper:
       function_name = "ErrorCastHelper";
       template_args.push_back(get_struct_name(function_info.cpp_name));
+      if (insert.exceptionFree) {
+        function_name = "TryErrorCastHelper";
+        args.push_back("udf_error");
+        insert.mayFail = true;
+      }
       break;
     case ScalarFunctionInfo::DecimalVectorBackWrapper:
       // udf_todo
@@ -233,6 +291,9 @@ String BoundExpressionCodeGenerator::CodeGenScalarFunction(
   String ret = function_info.cpp_name;
   // change the meta info for special cases
   SpecialCaseHandler(function_info, ret, template_args, children, insert, args);
+  if (insert.exceptionFree) {
+    nonThrowingOperator(ret, template_args, insert, args);
+  }
 
   // should only use the argument of the SpecialCaseHandler function, no more
   if (template_args.size() > 0) {
@@ -260,6 +321,24 @@ BoundExpressionCodeGenerator::Transpile(const BoundFunctionExpression &exp,
     for (size_t i = 0; i < exp.children.size(); i++) {
       children[i] = exp.children[i].get();
     }
+    // the overflow check is dead when the result always fits its type
+    auto typeRange = RangeAnalysis::getTypeRange(exp.return_type);
+    const String overflowCheck = "OperatorOverflowCheck::";
+    auto pos = function_info.cpp_name.find(overflowCheck);
+    if (insert.valueRanges && typeRange && pos != String::npos) {
+      auto range = RangeAnalysis::evaluateUnchecked(
+          exp, [&](const String &name) -> Opt<ValueRange> {
+            if (insert.valueRanges->count(name) == 0) {
+              return std::nullopt;
+            }
+            return insert.valueRanges->at(name);
+          });
+      if (range && range->fitsIn(*typeRange)) {
+        auto unchecked = function_info;
+        unchecked.cpp_name.replace(pos, overflowCheck.size(), "Operator::");
+        return CodeGenScalarFunction(unchecked, children, insert);
+      }
+    }
     return CodeGenScalarFunction(function_info, children, insert);
   } else {
     List<String> args;
@@ -0,0 +1,437 @@
+#include "loop_idiom_recognition.hpp"
+#include "duckdb/planner/expression/bound_cast_expression.hpp"
+#include "duckdb/planner/expression/bound_comparison_expression.hpp"
+#include "duckdb/planner/expression/bound_constant_expression.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "instructions.hpp"
+#include "loop_invariant_code_motion.hpp"
+#include "range_analysis.hpp"
+
+using duckdb::BoundCastExpression;
+using duckdb::BoundComparisonExpression;
+using duckdb::BoundConstantExpression;
+using duckdb::BoundFunctionExpression;
+using duckdb::Expression;
+using duckdb::ExpressionClass;
+using duckdb::ExpressionType;
+using Definitions = Map<const Variable *, const SelectExpression *>;
+
+static bool isIntegral(const duckdb::LogicalType &type) {
+  return RangeAnalysis::getTypeRange(type).has_value();
+}
+
+static const Expression &stripIntegralCasts(const Expression &expr) {
+  if (expr.GetExpressionClass() == ExpressionClass::BOUND_CAST) {
+    auto &cast = expr.Cast<BoundCastExpression>();
+    if (isIntegral(cast.child->return_type) && isIntegral(cast.return_type)) {
+      return stripIntegralCasts(*cast.child);
+    }
+  }
+  return expr;
+}
+
+static const Variable *getReferencedVariable(Function &f,
+                                             const Expression &expr) {
+  auto &stripped = stripIntegralCasts(expr);
+  if (stripped.GetExpressionClass() != ExpressionClass::BOUND_COLUMN_REF &&
+      stripped.GetExpressionClass() != ExpressionClass::BOUND_REF) {
+    return nullptr;
+  }
+  auto name = toLower(stripped.GetName());
+  return f.hasBinding(name) ? f.getBinding(name) : nullptr;
+}
+
+static bool isConstant(const Expression &expr, int64_t value) {
+  auto &stripped = stripIntegralCasts(expr);
+  if (stripped.GetExpressionClass() != ExpressionClass::BOUND_CONSTANT) {
+    return false;
+  }
+  auto &constant = stripped.Cast<BoundConstantExpression>();
+  return !constant.value.IsNull() && isIntegral(constant.return_type) &&
+         constant.value.GetValue<int64_t>() == value;
+}
+
+static const Expression &getExpression(const SelectExpression *expr) {
+  return *expr->getLogicalPlan()->expressions[0];
+}
+
+/**
+ * The call the expression evaluates to, following the assignments of the loop
+ * body, if it is one of the given functions
+ */
+static const BoundFunctionExpression *
+getCall(Function &f, const Expression &expr, const Definitions &definitions,
+        const Set<String> &names) {
+  auto &stripped = stripIntegralCasts(expr);
+  auto *var = getReferencedVariable(f, stripped);
+  if (var != nullptr && definitions.count(var) > 0) {
+    return getCall(f, getExpression(definitions.at(var)), definitions, names);
+  }
+  if (stripped.GetExpressionClass() != ExpressionClass::BOUND_FUNCTION) {
+    return nullptr;
+  }
+  auto &function = stripped.Cast<BoundFunctionExpression>();
+  return names.count(toLower(function.function.name)) > 0 ? &function
+                                                          : nullptr;
+}
+
+/**
+ * SUBSTRING(rest, position + 1[, LENGTH(rest)]), the string after the
+ * delimiter that was found
+ */
+bool LoopIdiomRecognitionPass::matchesNextRest(Function &f,
+                                               const Expression &expr,
+                                               const SplitLoop &info) const {
+  auto *substring =
+      getCall(f, expr, info.definitions, {"substring", "substr"});
+  if (substring == nullptr || substring->children.size() < 2 ||
+      substring->children.size() > 3 ||
+      getReferencedVariable(f, *substring->children[0]) != info.rest) {
+    return false;
+  }
+  auto &start = stripIntegralCasts(*substring->children[1]);
+  if (start.GetExpressionClass() != ExpressionClass::BOUND_FUNCTION) {
+    return false;
+  }
+  auto &plus = start.Cast<BoundFunctionExpression>();
+  if (plus.function.name != "+" || plus.children.size() != 2 ||
+      !((getReferencedVariable(f, *plus.children[0]) == info.position &&
+         isConstant(*plus.children[1], 1)) ||
+        (getReferencedVariable(f, *plus.children[1]) == info.position &&
+         isConstant(*plus.children[0], 1)))) {
+    return false;
+  }
+  if (substring->children.size() == 2) {
+    return true;
+  }
+  // any length that covers the rest of the string
+  auto *length = getCall(f, *substring->children[2], info.definitions,
+                         {"length", "strlen"});
+  return length != nullptr && length->children.size() == 1 &&
+         getReferencedVariable(f, *length->children[0]) == info.rest;
+}
+
+/**
+ * STRPOS(string, delimiter) with a delimiter that does not change in the loop
+ */
+bool LoopIdiomRecognitionPass::matchesPosition(Function &f,
+                                               const Expression &expr,
+                                               const Variable *string,
+                                               const Definitions &definitions,
+                                               SplitLoop &info) const {
+  auto *strpos = getCall(f, expr, definitions, {"strpos", "instr"});
+  if (strpos == nullptr || strpos->children.size() != 2 ||
+      getReferencedVariable(f, *strpos->children[0]) != string) {
+    return false;
+  }
+  auto &needle = stripIntegralCasts(*strpos->children[1]);
+  String delimiter;
+  if (auto *var = getReferencedVariable(f, needle)) {
+    if (var == info.rest || var == info.position ||
+        info.definitions.count(var) > 0) {
+      return false;
+    }
+    delimiter = var->getName();
+  } else if (needle.GetExpressionClass() == ExpressionClass::BOUND_CONSTANT &&
+             !needle.Cast<BoundConstantExpression>().value.IsNull()) {
+    delimiter = needle.Cast<BoundConstantExpression>().value.ToSQLString();
+  } else {
+    return false;
+  }
+  if (info.delimiter.empty()) {
+    info.delimiter = delimiter;
+  }
+  return info.delimiter == delimiter;
+}
+
+/**
+ * The expression in terms of the closed forms of the loop variables, the body
+ * assignments it reads are expanded in place
+ * Every iteration is evaluated, so nothing may raise an error that the loop
+ * would not have raised
+ */
+Opt<String>
+LoopIdiomRecognitionPass::expand(const SelectExpression *expr,
+                                 const SplitLoop &info,
+                                 const Map<String, String> &closedForms) const {
+  auto values = closedForms;
+  for (auto *var : expr->getUsedVariables()) {
+    if (info.definitions.count(var) == 0) {
+      continue;
+    }
+    auto *definition = info.definitions.at(var);
+    // the matched SUBSTRING only sees the positions of the delimiter
+    if (var != info.nextRest &&
+        !LoopInvariantCodeMotionPass::canSpeculate(definition)) {
+      return std::nullopt;
+    }
+    auto value = expand(definition, info, closedForms);
+    if (!value) {
+      return std::nullopt;
+    }
+    values[toLower(var->getName())] = *value;
+  }
+  return substituteIdentifiers(expr->getRawSQL(), values);
+}
+
+/**
+ * Recognizes the loop over the elements of a delimited string:
+ *   header: rest = Φ(s, rest'), position = Φ(STRPOS(s, d), position')
+ *   exiting: br position > 0 [body, exit]
+ *   body: straight-line pure assignments, br cond [return, ...]
+ *   latch: rest' = SUBSTRING(rest, position + 1, LENGTH(rest)),
+ *          position' = STRPOS(rest', d), jmp header
+ * The delimiter starts at the positions p1 < p2 < ... of s (found with
+ * substring(s, j, length(d)) = d), iteration k sees
+ *   rest = substring(s, p(k-1) + 1), position = p(k) - p(k-1)
+ * so the loop returns iff cond holds for some k, which is one list expression
+ */
+bool LoopIdiomRecognitionPass::rewriteLoop(Function &f, LoopRegion *loop) {
+  if (!loop->getMetadata().is_null()) {
+    return false;
+  }
+  auto *header = loop->getHeader();
+  auto loopBlocks = loop->getBasicBlocks();
+  SplitLoop info;
+  info.blocks = Set<BasicBlock *>(loopBlocks.begin(), loopBlocks.end());
+  info.rest = nullptr;
+  info.position = nullptr;
+  info.nextRest = nullptr;
+
+  auto *preheader = LoopInvariantCodeMotionPass::getPreheader(f, loop);
+  if (preheader == nullptr || header->getPredecessors().size() != 2) {
+    return false;
+  }
+  auto &headerPreds = header->getPredecessors();
+  auto *latch = headerPreds[0] == preheader ? headerPreds[1] : headerPreds[0];
+
+  // the header only holds the two phi nodes
+  Vec<const PhiNode *> phis;
+  for (auto &inst : *header) {
+    if (auto *phi = dynamic_cast<const PhiNode *>(&inst)) {
+      phis.push_back(phi);
+    } else if (&inst != header->getTerminator()) {
+      return false;
+    }
+  }
+  auto *headerBranch = dynamic_cast<BranchInst *>(header->getTerminator());
+  if (phis.size() != 2 || headerBranch == nullptr ||
+      headerBranch->isConditional()) {
+    return false;
+  }
+
+  // the exiting block only tests the position, the body is on the true edge
+  auto *exiting = headerBranch->getIfTrue();
+  auto *exitBranch = dynamic_cast<BranchInst *>(exiting->getTerminator());
+  if (exiting == header || info.blocks.count(exiting) == 0 ||
+      exitBranch == nullptr || !exitBranch->isConditional() ||
+      &*exiting->begin() != exiting->getTerminator() ||
+      info.blocks.count(exitBranch->getIfTrue()) == 0 ||
+      info.blocks.count(exitBranch->getIfFalse()) > 0 ||
+      exitBranch->getCond()->isSQLExpression()) {
+    return false;
+  }
+  auto *exit = exitBranch->getIfFalse();
+
+  // the body is a chain of blocks with a single conditional return
+  auto isReturnBlock = [&](BasicBlock *block) {
+    return info.blocks.count(block) > 0 &&
+           block->getPredecessors().size() == 1 &&
+           &*block->begin() == block->getTerminator() &&
+           dynamic_cast<ReturnInst *>(block->getTerminator()) != nullptr;
+  };
+  Set<BasicBlock *> visited = {header, exiting};
+  BasicBlock *returnBlock = nullptr;
+  const SelectExpression *cond = nullptr;
+  bool returnOnTrue = true;
+  auto *block = exitBranch->getIfTrue();
+  while (block != header) {
+    if (info.blocks.count(block) == 0 || !visited.insert(block).second) {
+      return false;
+    }
+    for (auto &inst : *block) {
+      if (&inst == block->getTerminator()) {
+        continue;
+      }
+      auto *assign = dynamic_cast<const Assignment *>(&inst);
+      if (assign == nullptr || !assign->getRHS()->isPure()) {
+        return false;
+      }
+      info.definitions.insert({assign->getLHS(), assign->getRHS()});
+    }
+    auto *branch = dynamic_cast<BranchInst *>(block->getTerminator());
+    if (branch == nullptr) {
+      return false;
+    }
+    if (!branch->isConditional()) {
+      block = branch->getIfTrue();
+      continue;
+    }
+    if (returnBlock != nullptr || !branch->getCond()->isPure()) {
+      return false;
+    }
+    cond = branch->getCond();
+    if (isReturnBlock(branch->getIfTrue())) {
+      returnBlock = branch->getIfTrue();
+      block = branch->getIfFalse();
+    } else if (isReturnBlock(branch->getIfFalse())) {
+      returnBlock = branch->getIfFalse();
+      returnOnTrue = false;
+      block = branch->getIfTrue();
+    } else {
+      return false;
+    }
+  }
+  if (returnBlock == nullptr || !visited.insert(returnBlock).second ||
+      visited.size() != loopBlocks.size()) {
+    return false;
+  }
+
+  // the loop runs while the position of the delimiter is positive
+  auto &condExpr = getExpression(exitBranch->getCond());
+  if (condExpr.GetExpressionClass() != ExpressionClass::BOUND_COMPARISON) {
+    return false;
+  }
+  auto &comparison = condExpr.Cast<BoundComparisonExpression>();
+  auto comparisonType = comparison.GetExpressionType();
+  const PhiNode *positionPhi = nullptr;
+  for (auto *phi : phis) {
+    if (getReferencedVariable(f, *comparison.left) == phi->getLHS() &&
+        isConstant(*comparison.right, 0) &&
+        (comparisonType == ExpressionType::COMPARE_GREATERTHAN ||
+         comparisonType == ExpressionType::COMPARE_NOTEQUAL)) {
+      positionPhi = phi;
+    } else if (getReferencedVariable(f, *comparison.right) == phi->getLHS() &&
+               isConstant(*comparison.left, 0) &&
+               (comparisonType == ExpressionType::COMPARE_LESSTHAN ||
+                comparisonType == ExpressionType::COMPARE_NOTEQUAL)) {
+      positionPhi = phi;
+    }
+  }
+  if (positionPhi == nullptr) {
+    return false;
+  }
+  auto *restPhi = phis[0] == positionPhi ? phis[1] : phis[0];
+  info.rest = restPhi->getLHS();
+  info.position = positionPhi->getLHS();
+
+  auto preheaderNumber = header->getPredNumber(preheader);
+  auto latchNumber = header->getPredNumber(latch);
+  auto *string = getReferencedVariable(
+      f, getExpression(restPhi->getRHS()[preheaderNumber]));
+  info.nextRest =
+      getReferencedVariable(f, getExpression(restPhi->getRHS()[latchNumber]));
+  // the initial position may be computed before the loop
+  Definitions allDefinitions;
+  for (auto &other : f) {
+    for (auto &inst : other) {
+      if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+        allDefinitions.insert({assign->getLHS(), assign->getRHS()});
+      }
+    }
+  }
+  if (string == nullptr || info.nextRest == nullptr ||
+      info.definitions.count(info.nextRest) == 0 ||
+      !matchesNextRest(f, getExpression(info.definitions.at(info.nextRest)),
+                       info) ||
+      !matchesPosition(f, getExpression(positionPhi->getRHS()[preheaderNumber]),
+                       string, allDefinitions, info) ||
+      !matchesPosition(f, getExpression(positionPhi->getRHS()[latchNumber]),
+                       info.nextRest, info.definitions, info)) {
+    return false;
+  }
+  info.init = string->getName();
+
+  // nothing computed in the loop is read after it
+  auto isLoopVariable = [&](const Variable *var) {
+    return var == info.rest || var == info.position ||
+           info.definitions.count(var) > 0;
+  };
+  for (auto &other : f) {
+    if (info.blocks.count(&other) > 0) {
+      continue;
+    }
+    for (auto &inst : other) {
+      auto operands = inst.getOperands();
+      if (std::any_of(operands.begin(), operands.end(), isLoopVariable)) {
+        return false;
+      }
+    }
+  }
+  auto *ret = dynamic_cast<ReturnInst *>(returnBlock->getTerminator());
+  auto &returnUses = ret->getExpr()->getUsedVariables();
+  if (!ret->getExpr()->isPure() ||
+      std::any_of(returnUses.begin(), returnUses.end(), isLoopVariable) ||
+      !LoopInvariantCodeMotionPass::canSpeculate(cond)) {
+    return false;
+  }
+
+  // the loop variables of iteration k__ over the delimiter positions
+  auto offset = String(
+      "(CASE WHEN k__ = 1 THEN 0 ELSE positions__[k__ - 1] END)");
+  Map<String, String> closedForms = {
+      {toLower(info.rest->getName()),
+       fmt::format("substring({}, {} + 1)", info.init, offset)},
+      {toLower(info.position->getName()),
+       fmt::format("CAST(positions__[k__] - {} AS {})", offset,
+                   info.position->getType().getDuckDBType())}};
+  auto condition = expand(cond, info, closedForms);
+  if (!condition) {
+    return false;
+  }
+  auto match = fmt::format(returnOnTrue ? "COALESCE({}, false)"
+                                        : "NOT COALESCE({}, false)",
+                           *condition);
+  auto query = fmt::format(
+      "(SELECT COALESCE(list_aggregate(list_transform(range(1, "
+      "len(positions__) + 1), k__ -> {}), 'bool_or'), false) FROM (SELECT "
+      "list_filter(range(1, length({}) + 1), j__ -> length({}) > 0 AND "
+      "substring({}, j__, length({})) = {}) AS positions__) AS split__)",
+      match, info.init, info.delimiter, info.init, info.delimiter,
+      info.delimiter);
+
+  // the header tests all iterations at once and returns or leaves the loop
+  auto *found = f.createTempVariable(Type::BOOLEAN, false);
+  auto *returnBlockCopy = f.makeBasicBlock();
+  returnBlockCopy->addInstruction(Make<ReturnInst>(ret->getExpr()->clone()));
+  for (auto it = header->begin(); it != header->end();) {
+    if (dynamic_cast<const PhiNode *>(&*it)) {
+      it = header->removeInst(it);
+    } else {
+      ++it;
+    }
+  }
+  header->insertBeforeTerminator(
+      Make<Assignment>(found, f.bindExpression(query, Type::BOOLEAN)));
+  exit->replacePredecessor(exiting, header);
+  header->getTerminator()->replaceWith(
+      Make<BranchInst>(returnBlockCopy, exit,
+                       f.bindExpression(found->getName(), Type::BOOLEAN)),
+      true);
+
+  for (auto *loopBlock : loopBlocks) {
+    if (loopBlock == header) {
+      continue;
+    }
+    for (auto it = loopBlock->begin(); it != loopBlock->end();) {
+      it = loopBlock->removeInst(it);
+    }
+  }
+  for (auto *loopBlock : loopBlocks) {
+    if (loopBlock != header) {
+      f.removeBasicBlock(loopBlock);
+    }
+  }
+  loop->getParentRegion()->replaceNestedRegion(
+      loop, Make<ConditionalRegion>(header, Make<LeafRegion>(returnBlockCopy))
+                .release());
+  return true;
+}
+
+bool LoopIdiomRecognitionPass::runOnFunction(Function &f) {
+  bool changed = false;
+  for (auto *loop : LoopInvariantCodeMotionPass::getLoops(f)) {
+    changed = rewriteLoop(f, loop) || changed;
+  }
+  return changed;
+}
@@ -0,0 +1,272 @@
+#include "loop_invariant_code_motion.hpp"
+#include "dominator_analysis.hpp"
+#include "duckdb/planner/expression/bound_cast_expression.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "duckdb/planner/expression_iterator.hpp"
+#include "instructions.hpp"
+#include "range_analysis.hpp"
+
+using duckdb::ExpressionClass;
+using duckdb::LogicalTypeId;
+
+Vec<LoopRegion *> LoopInvariantCodeMotionPass::getLoops(Function &f) {
+  Vec<LoopRegion *> loops;
+  std::function<void(const Region *)> visit = [&](const Region *region) {
+    if (auto *recursiveRegion = dynamic_cast<const RecursiveRegion *>(region)) {
+      for (auto *nested : recursiveRegion->getNestedRegions()) {
+        visit(nested);
+      }
+    }
+    if (dynamic_cast<const LoopRegion *>(region)) {
+      loops.push_back(
+          dynamic_cast<LoopRegion *>(region->getHeader()->getRegion()));
+    }
+  };
+  if (f.getRegion() != nullptr) {
+    visit(f.getRegion());
+  }
+  return loops;
+}
+
+BasicBlock *LoopInvariantCodeMotionPass::getLoopEntry(LoopRegion *loop) {
+  auto loopBlocks = loop->getBasicBlocks();
+  Set<BasicBlock *> loopSet(loopBlocks.begin(), loopBlocks.end());
+
+  Vec<BasicBlock *> outsidePreds;
+  for (auto *pred : loop->getHeader()->getPredecessors()) {
+    if (loopSet.count(pred) == 0) {
+      outsidePreds.push_back(pred);
+    }
+  }
+  return outsidePreds.size() == 1 ? outsidePreds.front() : nullptr;
+}
+
+BasicBlock *LoopInvariantCodeMotionPass::getPreheader(Function &f,
+                                                      LoopRegion *loop) {
+  auto *header = loop->getHeader();
+  auto *pred = getLoopEntry(loop);
+  if (pred == nullptr || pred->getSuccessors().size() == 1) {
+    return pred;
+  }
+
+  // split the edge into the loop, keeping the position of the predecessor
+  // so that the phi nodes of the header stay aligned
+  auto *preheader = f.makeBasicBlock();
+  pred->renameBasicBlock(header, preheader, nullptr);
+  header->replacePredecessor(pred, preheader);
+  preheader->addInstruction(Make<BranchInst>(header));
+  loop->getParentRegion()->wrapNestedRegion(
+      loop, [&](Own<Region> region) -> Own<Region> {
+        return Make<SequentialRegion>(preheader, std::move(region));
+      });
+  return preheader;
+}
+
+static bool isIntegral(const duckdb::LogicalType &type) {
+  return RangeAnalysis::getTypeRange(type).has_value();
+}
+
+static bool isFloatingPoint(const duckdb::LogicalType &type) {
+  return type.id() == LogicalTypeId::FLOAT ||
+         type.id() == LogicalTypeId::DOUBLE;
+}
+
+static bool canSpeculateExpression(const duckdb::Expression &expr) {
+  // functions that return a value (or NULL) for every input
+  static const Set<String> safeFunctions = {
+      "length", "strlen", "lower", "upper", "lcase", "ucase", "concat", "||",
+      "year",   "month",  "day",   "isnan", "isinf", "prefix", "suffix",
+      "contains", "strpos", "instr", "left", "right", "ltrim", "rtrim",
+      "trim"};
+
+  switch (expr.GetExpressionClass()) {
+  case ExpressionClass::BOUND_CONSTANT:
+  case ExpressionClass::BOUND_COLUMN_REF:
+  case ExpressionClass::BOUND_REF:
+  case ExpressionClass::BOUND_COMPARISON:
+  case ExpressionClass::BOUND_CONJUNCTION:
+  case ExpressionClass::BOUND_OPERATOR:
+  case ExpressionClass::BOUND_CASE:
+  case ExpressionClass::BOUND_BETWEEN:
+    break;
+  case ExpressionClass::BOUND_CAST: {
+    auto &cast = expr.Cast<duckdb::BoundCastExpression>();
+    auto &source = cast.child->return_type;
+    auto &target = cast.return_type;
+    bool widening =
+        source == target || target.id() == LogicalTypeId::VARCHAR ||
+        (isIntegral(source) && isFloatingPoint(target)) ||
+        (isIntegral(source) && isIntegral(target) &&
+         RangeAnalysis::getTypeRange(source)->fitsIn(
+             *RangeAnalysis::getTypeRange(target))) ||
+        (source.id() == LogicalTypeId::DATE &&
+         target.id() == LogicalTypeId::TIMESTAMP);
+    if (!widening) {
+      return false;
+    }
+    break;
+  }
+  case ExpressionClass::BOUND_FUNCTION: {
+    auto &function = expr.Cast<duckdb::BoundFunctionExpression>();
+    auto &name = function.function.name;
+    // floating point arithmetic saturates to infinity instead of failing
+    bool arithmetic = name == "+" || name == "-" || name == "*" || name == "/";
+    if (!(arithmetic && isFloatingPoint(function.return_type)) &&
+        safeFunctions.count(name) == 0) {
+      return false;
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+
+  bool safe = true;
+  duckdb::ExpressionIterator::EnumerateChildren(
+      expr, [&](const duckdb::Expression &child) {
+        safe = safe && canSpeculateExpression(child);
+      });
+  return safe;
+}
+
+bool LoopInvariantCodeMotionPass::canSpeculate(const SelectExpression *expr) {
+  if (!expr->isPure()) {
+    return false;
+  }
+  return canSpeculateExpression(*expr->getLogicalPlan()->expressions[0]);
+}
+
+bool LoopInvariantCodeMotionPass::hoistFromLoop(
+    Function &f, LoopRegion *loop, BasicBlock *entry,
+    Map<BasicBlock *, BasicBlock *> &idom,
+    Map<const Variable *, BasicBlock *> &defBlocks) {
+  // the edge into the loop is only split once there is code to hoist
+  BasicBlock *preheader = entry->getSuccessors().size() == 1 ? entry : nullptr;
+  auto getPreheader = [&]() {
+    if (preheader == nullptr) {
+      preheader = LoopInvariantCodeMotionPass::getPreheader(f, loop);
+      idom.insert_or_assign(preheader, entry);
+      idom.insert_or_assign(loop->getHeader(), preheader);
+    }
+    return preheader;
+  };
+
+  auto loopBlocks = loop->getBasicBlocks();
+  Set<BasicBlock *> loopSet(loopBlocks.begin(), loopBlocks.end());
+
+  // blocks that leave the loop or return from the function
+  Vec<BasicBlock *> exits;
+  for (auto *block : loopBlocks) {
+    auto successors = block->getSuccessors();
+    if (dynamic_cast<ReturnInst *>(block->getTerminator()) ||
+        std::any_of(successors.begin(), successors.end(),
+                    [&](BasicBlock *succ) {
+                      return loopSet.count(succ) == 0;
+                    })) {
+      exits.push_back(block);
+    }
+  }
+
+  auto dominates = [&](BasicBlock *dominator, BasicBlock *block) {
+    while (block != nullptr) {
+      if (block == dominator) {
+        return true;
+      }
+      block = idom.find(block) == idom.end() ? nullptr : idom.at(block);
+    }
+    return false;
+  };
+
+  // code that runs whenever the loop is entered may be hoisted even if it can
+  // fail, other code only if it can not
+  auto canHoist = [&](BasicBlock *block, const SelectExpression *expr) {
+    if (expr->isTrivial() || !expr->isPure()) {
+      return false;
+    }
+    for (auto *var : expr->getUsedVariables()) {
+      if (defBlocks.find(var) != defBlocks.end() &&
+          loopSet.count(defBlocks.at(var)) > 0) {
+        return false;
+      }
+    }
+    return canSpeculate(expr) ||
+           std::all_of(exits.begin(), exits.end(), [&](BasicBlock *exit) {
+             return dominates(block, exit);
+           });
+  };
+
+  bool changed = false;
+  bool hoisted = true;
+  while (hoisted) {
+    hoisted = false;
+    for (auto *block : loopBlocks) {
+      for (auto it = block->begin(); it != block->end();) {
+        auto *assign = dynamic_cast<const Assignment *>(&*it);
+        if (assign == nullptr || !canHoist(block, assign->getRHS())) {
+          ++it;
+          continue;
+        }
+        getPreheader()->insertBeforeTerminator(assign->clone());
+        defBlocks.insert_or_assign(assign->getLHS(), preheader);
+        it = block->removeInst(it);
+        hoisted = true;
+      }
+
+      // an invariant condition is computed once before the loop
+      auto *branch = dynamic_cast<BranchInst *>(block->getTerminator());
+      if (branch != nullptr && branch->isConditional() &&
+          canHoist(block, branch->getCond())) {
+        auto *condVar = f.createTempVariable(Type::BOOLEAN, true);
+        getPreheader()->insertBeforeTerminator(
+            Make<Assignment>(condVar, branch->getCond()->clone()));
+        defBlocks.insert_or_assign(condVar, preheader);
+        branch->replaceWith(Make<BranchInst>(
+            branch->getIfTrue(), branch->getIfFalse(),
+            f.bindExpression(condVar->getName(), Type::BOOLEAN)));
+        hoisted = true;
+      }
+      changed = changed || hoisted;
+    }
+  }
+  return changed;
+}
+
+bool LoopInvariantCodeMotionPass::runOnFunction(Function &f) {
+  bool changed = false;
+
+  // loops entered from a single block, their preheader is created when
+  // something is hoisted out of them
+  Vec<std::pair<LoopRegion *, BasicBlock *>> loops;
+  for (auto *loop : getLoops(f)) {
+    auto *entry = getLoopEntry(loop);
+    if (entry != nullptr && entry != f.getEntryBlock()) {
+      loops.emplace_back(loop, entry);
+    }
+  }
+
+  DominatorAnalysis dominatorAnalysis(f);
+  dominatorAnalysis.runAnalysis();
+  const auto &dominatorTree = dominatorAnalysis.getDominatorTree();
+  Map<BasicBlock *, BasicBlock *> idom;
+  for (auto &block : f) {
+    for (auto &child : dominatorTree->getChildren(block.getLabel())) {
+      idom.insert({f.getBlockFromLabel(child), &block});
+    }
+  }
+
+  Map<const Variable *, BasicBlock *> defBlocks;
+  for (auto &block : f) {
+    for (auto &inst : block) {
+      if (auto *var = inst.getResultOperand()) {
+        defBlocks.insert({var, &block});
+      }
+    }
+  }
+
+  // inner loops come first, so code hoisted into their preheader can be
+  // hoisted again out of the enclosing loop
+  for (auto &[loop, entry] : loops) {
+    changed = hoistFromLoop(f, loop, entry, idom, defBlocks) || changed;
+  }
+  return changed;
+}
@@ -0,0 +1,120 @@
+#include "loop_unswitching.hpp"
+#include "instructions.hpp"
+#include "loop_invariant_code_motion.hpp"
+
+/**
+ * A structured IF inside the loop body whose condition is not changed by the
+ * loop and can be evaluated before it
+ */
+BasicBlock *LoopUnswitchingPass::findInvariantBranch(LoopRegion *loop) const {
+  auto loopBlocks = loop->getBasicBlocks();
+  Set<BasicBlock *> loopSet(loopBlocks.begin(), loopBlocks.end());
+
+  std::size_t loopSize = 0;
+  Set<const Variable *> assigned;
+  for (auto *block : loopBlocks) {
+    for (auto &inst : *block) {
+      // don't duplicate queries (e.g. cursor loops)
+      if (inst.hasSelect()) {
+        return nullptr;
+      }
+      if (auto *var = inst.getResultOperand()) {
+        assigned.insert(var);
+      }
+      ++loopSize;
+    }
+  }
+  if (loopSize > MAX_LOOP_SIZE) {
+    return nullptr;
+  }
+
+  for (auto *block : loopBlocks) {
+    auto *region = dynamic_cast<ConditionalRegion *>(block->getRegion());
+    auto *branch = dynamic_cast<BranchInst *>(block->getTerminator());
+    if (region == nullptr || branch == nullptr || !branch->isConditional()) {
+      continue;
+    }
+    // skip the exit condition of the loop
+    if (loopSet.count(branch->getIfTrue()) == 0 ||
+        loopSet.count(branch->getIfFalse()) == 0) {
+      continue;
+    }
+    auto *cond = branch->getCond();
+    if (cond->getUsedVariables().empty() ||
+        !LoopInvariantCodeMotionPass::canSpeculate(cond)) {
+      continue;
+    }
+    auto &used = cond->getUsedVariables();
+    if (std::none_of(used.begin(), used.end(), [&](const Variable *var) {
+          return assigned.count(var) > 0;
+        })) {
+      return block;
+    }
+  }
+  return nullptr;
+}
+
+void LoopUnswitchingPass::unswitchLoop(Function &f, LoopRegion *loop,
+                                       BasicBlock *preheader,
+                                       BasicBlock *branchBlock) {
+  auto loopBlocks = loop->getBasicBlocks();
+
+  // copy the blocks of the loop, exits still go to the original targets
+  FunctionCloneAndRenameHelper cloneHelper;
+  for (auto *var : f.getAllVariables()) {
+    cloneHelper.variableMap.insert({var, var});
+  }
+  for (auto *block : loopBlocks) {
+    cloneHelper.basicBlockMap.insert({block, f.makeBasicBlock()});
+  }
+  for (auto *block : loopBlocks) {
+    auto *newBlock = cloneHelper.basicBlockMap.at(block);
+    for (auto &inst : *block) {
+      newBlock->addInstruction(cloneHelper.cloneAndRename(inst));
+    }
+  }
+
+  // test the condition once and enter the matching copy of the loop
+  auto *branch = dynamic_cast<BranchInst *>(branchBlock->getTerminator());
+  auto *dispatchBlock = f.makeBasicBlock();
+  dispatchBlock->addInstruction(Make<BranchInst>(
+      loop->getHeader(), cloneHelper.basicBlockMap.at(loop->getHeader()),
+      branch->getCond()->clone()));
+  preheader->getTerminator()->replaceWith(Make<BranchInst>(dispatchBlock),
+                                          true);
+
+  // inside each copy the outcome is known
+  for (auto [block, outcome] :
+       {std::make_pair(branchBlock, "true"),
+        std::make_pair(cloneHelper.basicBlockMap.at(branchBlock), "false")}) {
+    auto *oldBranch = dynamic_cast<BranchInst *>(block->getTerminator());
+    oldBranch->replaceWith(
+        Make<BranchInst>(oldBranch->getIfTrue(), oldBranch->getIfFalse(),
+                         f.bindExpression(outcome, Type::BOOLEAN)));
+  }
+
+  auto newLoop = cloneHelper.cloneAndRenameRegion(loop);
+  loop->getParentRegion()->wrapNestedRegion(
+      loop, [&](Own<Region> region) -> Own<Region> {
+        return Make<ConditionalRegion>(dispatchBlock, std::move(region),
+                                       std::move(newLoop));
+      });
+}
+
+bool LoopUnswitchingPass::runOnFunction(Function &f) {
+  bool changed = false;
+  for (auto *loop : LoopInvariantCodeMotionPass::getLoops(f)) {
+    auto *branchBlock = findInvariantBranch(loop);
+    if (branchBlock == nullptr) {
+      continue;
+    }
+    auto *preheader = LoopInvariantCodeMotionPass::getPreheader(f, loop);
+    if (preheader == nullptr || preheader == f.getEntryBlock() ||
+        loop->getParentRegion()->getHeader() != preheader) {
+      continue;
+    }
+    unswitchLoop(f, loop, preheader, branchBlock);
+    changed = true;
+  }
+  return changed;
+}
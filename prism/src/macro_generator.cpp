@@ -0,0 +1,373 @@
+#include "macro_generator.hpp"
+#include "aggify_pass.hpp"
+#include "ast_to_cfg.hpp"
+#include "instructions.hpp"
+#include "udf_transpiler_extension.hpp"
+
+static String select(const String &cond, const String &ifTrue,
+                     const String &ifFalse) {
+  if (ifTrue == ifFalse || cond == "true") {
+    return ifTrue;
+  } else if (cond == "false") {
+    return ifFalse;
+  }
+  return fmt::format("CASE WHEN ({}) THEN ({}) ELSE ({}) END", cond, ifTrue,
+                     ifFalse);
+}
+
+/**
+ * Whether the rest of the region is skipped by a return, an EXIT or a CONTINUE
+ */
+static String getStopped(const String &returned, const String &exited,
+                         const String &continued) {
+  Vec<String> flags;
+  for (auto *flag : {&returned, &exited, &continued}) {
+    if (*flag != "false") {
+      flags.push_back("(" + *flag + ")");
+    }
+  }
+  return flags.empty() ? "false" : joinVector(flags, " OR ");
+}
+
+
+/**
+ * Matches the SQL made from a format string with named arguments, each
+ * argument matches its pattern instead
+ */
+static std::regex formatToRegex(const String &format,
+                                const Map<String, String> &patterns) {
+  static const std::regex special(R"([.^$|()[\]{}*+?\\])");
+  static const std::regex argument(R"(\{(\w+)\})");
+  auto escape = [&](const String &text) {
+    return std::regex_replace(text, special, "\\$&");
+  };
+  String regex;
+  auto it = format.cbegin();
+  std::sregex_iterator match(format.cbegin(), format.cend(), argument), end;
+  for (; match != end; ++match) {
+    regex += escape(String(it, (*match)[0].first)) +
+             patterns.at((*match)[1].str());
+    it = (*match)[0].second;
+  }
+  regex += escape(String(it, format.cend()));
+  return std::regex(regex, std::regex::icase);
+}
+
+/**
+ * A cursor loop counts the rows of its fetch query and fetches each field of
+ * the current row with it, so the query would run again on every iteration
+ * Both read the materialized cursor of the loop instead
+ */
+String MacroGenerator::readCursors(const String &text,
+                                   LoweringContext &context) const {
+  if (context.loop == nullptr ||
+      duckdb::optimizerPassOnMap.at("MaterializedCursors") == false) {
+    return text;
+  }
+  static const std::regex countRegex =
+      formatToRegex(AstToCFG::CURSOR_LOOP_CONDITION,
+                    {{"fetchQuery", "([\\s\\S]*)"}});
+  static const std::regex fieldRegex =
+      formatToRegex(AstToCFG::CURSOR_LOOP_FIELD,
+                    {{"field", "(fetchQueryVar\\d+)"},
+                     {"fetchQuery", "([\\s\\S]*)"},
+                     {"columns", "([^)]*)"}});
+
+  auto getCursor = [&](const String &fetchQuery) -> Cursor & {
+    if (context.cursors.count(fetchQuery) == 0) {
+      context.cursors[fetchQuery] = {
+          fmt::format("loop{}_cursor{}", context.ctes.size(),
+                      context.cursors.size()),
+          ""};
+    }
+    return context.cursors.at(fetchQuery);
+  };
+
+  std::smatch matches;
+  if (std::regex_search(text, matches, countRegex)) {
+    auto &cursor = getCursor(matches[1].str());
+    return matches.prefix().str() +
+           fmt::format("(cursorloopiter < (SELECT count(*) FROM {}))",
+                       cursor.name) +
+           matches.suffix().str();
+  } else if (std::regex_search(text, matches, fieldRegex)) {
+    auto &cursor = getCursor(matches[2].str());
+    cursor.columns = matches[3].str();
+    return matches.prefix().str() +
+           fmt::format("(SELECT {1} FROM {0} WHERE {0}.cursorpos__ = "
+                       "cursorloopiter)",
+                       cursor.name, matches[1].str()) +
+           matches.suffix().str();
+  }
+  return text;
+}
+
+String MacroGenerator::lowerExpression(const String &text,
+                                       const MacroState &state,
+                                       LoweringContext &context) const {
+  return substituteIdentifiers(readCursors(text, context), state.values);
+}
+
+/**
+ * The state after an IF, a NULL condition takes the false branch like in
+ * PL/pgSQL
+ */
+MacroGenerator::MacroState
+MacroGenerator::merge(const String &cond, const MacroState &trueState,
+                      const MacroState &falseState) const {
+  MacroState state;
+  for (auto &[name, value] : trueState.values) {
+    state.values[name] = select(cond, value, falseState.values.at(name));
+  }
+  state.returned = select(cond, trueState.returned, falseState.returned);
+  state.result = select(cond, trueState.result, falseState.result);
+  state.exited = select(cond, trueState.exited, falseState.exited);
+  state.continued = select(cond, trueState.continued, falseState.continued);
+  return state;
+}
+
+/**
+ * Inside a loop, a jump to the header continues with the next iteration and a
+ * jump out of the loop exits it
+ */
+void MacroGenerator::jumpTo(const BasicBlock *target, MacroState &state,
+                            const LoweringContext &context) const {
+  if (context.loop == nullptr) {
+    return;
+  }
+  auto stopped = getStopped(state.returned, state.exited, state.continued);
+  if (target == context.loop->getHeader()) {
+    state.continued = select(stopped, state.continued, "true");
+  } else if (getEnclosingLoop(target) != context.loop) {
+    state.exited = select(stopped, state.exited, "true");
+  }
+}
+
+bool MacroGenerator::lowerBlock(const Function &f, const BasicBlock *block,
+                                MacroState &state,
+                                LoweringContext &context) const {
+  for (auto &inst : *block) {
+    auto stopped = getStopped(state.returned, state.exited, state.continued);
+    if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+      auto name = toLower(assign->getLHS()->getName());
+      auto value = fmt::format(
+          "CAST(({}) AS {})",
+          lowerExpression(assign->getRHS()->getRawSQL(), state, context),
+          assign->getLHS()->getType().getDuckDBType());
+      // after a return the variables are not read anymore, but in a loop the
+      // skipped assignments must keep the values of the iteration
+      if (context.loop != nullptr) {
+        value = select(stopped, state.values.at(name), value);
+      }
+      if (value.size() > MAX_MACRO_SIZE) {
+        return false;
+      }
+      state.values[name] = value;
+    } else if (auto *ret = dynamic_cast<const ReturnInst *>(&inst)) {
+      auto value = fmt::format(
+          "CAST(({}) AS {})",
+          lowerExpression(ret->getExpr()->getRawSQL(), state, context),
+          f.getReturnType().getDuckDBType());
+      // keep the value of a return on an earlier path
+      state.result = select(stopped, state.result, value);
+      state.returned = select(stopped, state.returned, "true");
+      if (state.result.size() > MAX_MACRO_SIZE) {
+        return false;
+      }
+    } else if (auto *branch = dynamic_cast<const BranchInst *>(&inst)) {
+      if (branch->isUnconditional()) {
+        jumpTo(branch->getIfTrue(), state, context);
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * A loop becomes a recursive CTE with a row per iteration, its columns carry
+ * the state of the function and the row where the loop stopped holds the state
+ * after the loop:
+ *   loopN(exited__, returned__, result__, vars...) AS (
+ *     SELECT <state before the loop>
+ *     UNION ALL
+ *     SELECT <state after an iteration> FROM loopN WHERE <not stopped>)
+ *   loopN_result AS (SELECT * FROM loopN WHERE <stopped>)
+ * Only loops that run unconditionally are lowered, the CTEs are evaluated
+ * whatever the branches taken
+ */
+bool MacroGenerator::lowerLoop(const Function &f, const LoopRegion *loop,
+                               MacroState &state,
+                               LoweringContext &context) const {
+  if (context.loop != nullptr || context.conditional ||
+      duckdb::optimizerPassOnMap.at("RecursiveCTELowering") == false) {
+    return false;
+  }
+  auto name = fmt::format("loop{}", context.ctes.size());
+
+  Vec<String> vars;
+  for (auto &[var, _] : state.values) {
+    vars.push_back(var);
+  }
+  std::sort(vars.begin(), vars.end());
+  Vec<String> columns = {"exited__", "returned__", "result__"};
+  Vec<String> initial = {"false", state.returned, state.result};
+  MacroState iteration;
+  for (auto &var : vars) {
+    columns.push_back(var);
+    initial.push_back(state.values.at(var));
+    iteration.values[var] = name + "." + var;
+  }
+  iteration.result = name + ".result__";
+
+  context.loop = loop;
+  bool lowered = lowerBlock(f, loop->getHeader(), iteration, context) &&
+                 lowerRegion(f, loop->getBodyRegion(), iteration, context);
+  context.loop = nullptr;
+  if (!lowered) {
+    return false;
+  }
+
+  // the fetch query of a cursor loop runs once before the loop like in
+  // PL/pgSQL, its rows are numbered by the keys of its ORDER BY since the
+  // scan of a parallel plan does not keep the order
+  for (auto &[fetchQuery, cursor] : context.cursors) {
+    auto query = substituteIdentifiers(fetchQuery, state.values);
+    if (!context.lastResult.empty() &&
+        query.find(context.lastResult) != String::npos) {
+      return false;
+    }
+    auto fieldCount =
+        cursor.columns.empty()
+            ? 0
+            : std::count(cursor.columns.begin(), cursor.columns.end(), ',') +
+                  1;
+    auto orderedFetch = AggifyPass::orderFetchQuery(query, fieldCount);
+    if (!orderedFetch) {
+      return false;
+    }
+    auto cte = fmt::format(
+        "{} AS MATERIALIZED (SELECT row_number() OVER ({}) - 1 AS "
+        "cursorpos__, * FROM ({}) fetchQueryTmpTable{})",
+        cursor.name, orderedFetch->orderBy, orderedFetch->query,
+        cursor.columns.empty() ? "" : "(" + cursor.columns + ")");
+    if (cte.size() > MAX_MACRO_SIZE) {
+      return false;
+    }
+    context.ctes.push_back(cte);
+  }
+  context.cursors.clear();
+
+  Vec<String> step = {iteration.exited, iteration.returned, iteration.result};
+  for (auto &var : vars) {
+    step.push_back(iteration.values.at(var));
+  }
+  auto cte = fmt::format(
+      "{0}({1}) AS (SELECT {2}{3} UNION ALL SELECT {4} FROM {0} WHERE NOT "
+      "({0}.exited__ OR {0}.returned__)), {0}_result AS (SELECT * FROM {0} "
+      "WHERE exited__ OR returned__)",
+      name, joinVector(columns, ", "), joinVector(initial, ", "),
+      context.lastResult.empty() ? "" : " FROM " + context.lastResult,
+      joinVector(step, ", "));
+  if (cte.size() > MAX_MACRO_SIZE) {
+    return false;
+  }
+  context.ctes.push_back(cte);
+  context.lastResult = name + "_result";
+
+  // the state after the loop is read from the row where it stopped
+  for (auto &var : vars) {
+    state.values[var] = context.lastResult + "." + var;
+  }
+  state.returned = context.lastResult + ".returned__";
+  state.result = context.lastResult + ".result__";
+  return true;
+}
+
+bool MacroGenerator::lowerRegion(const Function &f, const Region *region,
+                                 MacroState &state,
+                                 LoweringContext &context) const {
+  if (auto *sequentialRegion = dynamic_cast<const SequentialRegion *>(region)) {
+    return lowerBlock(f, sequentialRegion->getHeader(), state, context) &&
+           lowerRegion(f, sequentialRegion->getNestedRegion(), state,
+                       context) &&
+           (sequentialRegion->getFallthroughRegion() == nullptr ||
+            lowerRegion(f, sequentialRegion->getFallthroughRegion(), state,
+                        context));
+  } else if (auto *leafRegion = dynamic_cast<const LeafRegion *>(region)) {
+    return lowerBlock(f, leafRegion->getHeader(), state, context);
+  } else if (auto *conditionalRegion =
+                 dynamic_cast<const ConditionalRegion *>(region)) {
+    auto *header = conditionalRegion->getHeader();
+    if (!lowerBlock(f, header, state, context)) {
+      return false;
+    }
+    auto *branch = dynamic_cast<const BranchInst *>(header->getTerminator());
+    if (branch == nullptr || !branch->isConditional() ||
+        branch->getIfTrue() !=
+            conditionalRegion->getTrueRegion()->getHeader()) {
+      return false;
+    }
+    auto cond =
+        lowerExpression(branch->getCond()->getRawSQL(), state, context);
+    auto trueState = state;
+    auto falseState = state;
+    bool conditional = context.conditional;
+    context.conditional = true;
+    bool lowered =
+        lowerRegion(f, conditionalRegion->getTrueRegion(), trueState,
+                    context) &&
+        (conditionalRegion->getFalseRegion() == nullptr ||
+         lowerRegion(f, conditionalRegion->getFalseRegion(), falseState,
+                     context));
+    context.conditional = conditional;
+    if (!lowered) {
+      return false;
+    }
+    if (conditionalRegion->getFalseRegion() == nullptr) {
+      jumpTo(branch->getIfFalse(), falseState, context);
+    }
+    state = merge(cond, trueState, falseState);
+    return state.result.size() <= MAX_MACRO_SIZE;
+  } else if (auto *loopRegion = dynamic_cast<const LoopRegion *>(region)) {
+    return lowerLoop(f, loopRegion, state, context);
+  }
+  return false;
+}
+
+Opt<String> MacroGenerator::run(const Function &f) const {
+  // variables read before being assigned are NULL
+  MacroState state;
+  for (auto &arg : f.getArguments()) {
+    state.values[toLower(arg->getName())] = arg->getName();
+  }
+  for (auto &var : f.getVariables()) {
+    state.values[toLower(var->getName())] =
+        fmt::format("CAST(NULL AS {})", var->getType().getDuckDBType());
+  }
+  state.result =
+      fmt::format("CAST(NULL AS {})", f.getReturnType().getDuckDBType());
+
+  LoweringContext context;
+  if (f.getRegion() == nullptr ||
+      !lowerRegion(f, f.getRegion(), state, context) ||
+      state.returned == "false") {
+    return std::nullopt;
+  }
+
+  auto body = state.result;
+  if (!context.ctes.empty()) {
+    body = fmt::format("(WITH RECURSIVE {} SELECT {} FROM {})",
+                       joinVector(context.ctes, ", "), state.result,
+                       context.lastResult);
+  }
+  Vec<String> args;
+  for (auto &arg : f.getArguments()) {
+    args.push_back(arg->getName());
+  }
+  return fmt::format(fmt::runtime(config.plpgsql["macroTemplate"].Scalar()),
+                     fmt::arg("functionName", f.getFunctionName()),
+                     fmt::arg("functionArgs", joinVector(args, ", ")),
+                     fmt::arg("body", body));
+}
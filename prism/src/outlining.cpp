@@ -3,16 +3,22 @@
 #include "cfg_to_ast.hpp"
 #include "compiler.hpp"
 #include "dead_code_elimination.hpp"
+#include "duckdb/planner/expression_iterator.hpp"
 #include "file.hpp"
 #include "instructions.hpp"
 #include "liveness_analysis.hpp"
 #include "merge_regions.hpp"
 #include "pipeline_pass.hpp"
+#include "range_analysis.hpp"
 #include "remove_unused_variable.hpp"
 #include "ssa_destruction.hpp"
 #include "udf_transpiler_extension.hpp"
 #include "utils.hpp"
 
+// the fields of a tagged result: which exit was taken and the value returned
+static const String EXIT_TAG = "exit_tag";
+static const String EXIT_VALUE = "exit_value";
+
 /**
  * Robust way to find the outgoing branch out of this list of blocks
  */
@@ -35,6 +41,15 @@ getNextBasicBlock(const Vec<BasicBlock *> &basicBlocks) {
 
 void OutliningPass::outlineFunction(Function &f) {
   drawGraph(f.getCFGString(), "cfg_outlined");
+
+  // the ranges need the SSA form, record them for the code generator
+  if (duckdb::optimizerPassOnMap.at("RangeAnalysis") == true) {
+    RangeAnalysis rangeAnalysis(f);
+    rangeAnalysis.runAnalysis();
+    f.setValueRanges(
+        rangeAnalysis.getVariableRanges()->getRangesByOriginalName());
+  }
+
   auto ssaDestructionPipeline = Make<PipelinePass>(
       Make<DeadCodeEliminationPass>(), Make<SSADestructionPass>(),
       Make<RemoveUnusedVariablePass>());
@@ -64,6 +79,92 @@ void OutliningPass::outlineFunction(Function &f) {
   compiler.getUdfCount()++;
 }
 
+static std::size_t getExpressionCost(const duckdb::Expression &expr) {
+  // string handling dominates the evaluation of an expression
+  std::size_t cost =
+      expr.return_type.id() == duckdb::LogicalTypeId::VARCHAR ? 4 : 1;
+  duckdb::ExpressionIterator::EnumerateChildren(
+      expr, [&](const duckdb::Expression &child) {
+        cost += getExpressionCost(child);
+      });
+  return cost;
+}
+
+/**
+ * Compares the per-row cost of leaving the blocks in SQL with the cost of a
+ * call to the compiled C++ function
+ * The cardinality of the calling query is not known when the UDF is compiled,
+ * so the planning of the inlined statements is amortized over an estimate
+ */
+bool OutliningPass::isWorthOutlining(const Vec<BasicBlock *> &basicBlocks,
+                                     std::size_t numArgs,
+                                     bool planStatements) const {
+  Set<const BasicBlock *> blockSet(basicBlocks.begin(), basicBlocks.end());
+  std::size_t sqlCost = 0;
+  std::size_t cppCost = CALL_COST + ARGUMENT_COST * numArgs;
+  std::size_t statements = 0;
+  for (auto *block : basicBlocks) {
+    // the loops around the block that are part of the region
+    std::size_t iterations = 1;
+    for (Region *region = block->getRegion(); region != nullptr;
+         region = region->getParentRegion()) {
+      if (dynamic_cast<LoopRegion *>(region) &&
+          blockSet.count(region->getHeader()) > 0) {
+        iterations *= ESTIMATED_LOOP_ITERATIONS;
+      }
+    }
+    if (dynamic_cast<LoopRegion *>(block->getRegion())) {
+      sqlCost += SQL_LOOP_COST * iterations;
+    }
+
+    for (auto &inst : *block) {
+      const SelectExpression *expr = nullptr;
+      if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+        expr = assign->getRHS();
+      } else if (auto *ret = dynamic_cast<const ReturnInst *>(&inst)) {
+        expr = ret->getExpr();
+      } else if (auto *branch = dynamic_cast<const BranchInst *>(&inst)) {
+        expr = branch->isConditional() ? branch->getCond() : nullptr;
+      }
+      if (expr == nullptr) {
+        continue;
+      }
+      auto cost =
+          getExpressionCost(*expr->getLogicalPlan()->expressions[0]) *
+          iterations;
+      sqlCost += cost * SQL_EXPRESSION_COST;
+      cppCost += cost * CPP_EXPRESSION_COST;
+      ++statements;
+    }
+  }
+  if (planStatements) {
+    sqlCost += PLANNING_COST * statements / ESTIMATED_CALLER_ROWS;
+  }
+
+  INFO(fmt::format("Cost of the region at {}: {} as SQL, {} as C++.",
+                   basicBlocks.front()->getLabel(), sqlCost, cppCost));
+  return cppCost < sqlCost;
+}
+
+/**
+ * The value stored in the fields of a tagged result that are not set by an exit
+ */
+static String getDefaultValue(const Type &type) {
+  return fmt::format("CAST({} AS {})", type.isBlob() ? "''" : "0",
+                     type.getDuckDBType());
+}
+
+bool OutliningPass::isWorthOutlining(Function &f) const {
+  Vec<BasicBlock *> basicBlocks;
+  for (auto &block : f) {
+    if (&block != f.getEntryBlock()) {
+      basicBlocks.push_back(&block);
+    }
+  }
+  return !basicBlocks.empty() &&
+         isWorthOutlining(basicBlocks, f.getArguments().size(), false);
+}
+
 static bool allBlocksNaive(const Vec<BasicBlock *> &basicBlocks) {
   // check if all the basic blocks are naive (just jmps)
   // check if there is at least a conditional or a loop within the blocks
@@ -123,15 +224,35 @@ bool OutliningPass::outlineBasicBlocks(Vec<BasicBlock *> blocksToOutline,
     }
   }
 
-  if (nextBasicBlock != nullptr && hasReturn) {
-    INFO("Control logic does not go to end but has return, this pattern cannot "
-         "be outlined for now.");
-    return false;
-  } else if (nextBasicBlock == nullptr && !hasReturn) {
+  if (nextBasicBlock == nullptr && !hasReturn) {
     EXCEPTION(fmt::format("Control logic goes to end but no return."));
   }
-  // rest two cases are both valid
-  bool outliningEndRegion = nextBasicBlock == nullptr && hasReturn;
+  bool outliningEndRegion = nextBasicBlock == nullptr;
+  // a region that also returns early gives back a tagged result, the caller
+  // dispatches on the exit taken by the outlined function
+  bool taggedResult = nextBasicBlock != nullptr && hasReturn;
+
+  // get the predecessors of nextBasicBlock that are in the region
+  Set<BasicBlock *> blocksToOutlineSet(blocksToOutline.begin(),
+                                       blocksToOutline.end());
+  Vec<BasicBlock *> nextPreds;
+  if (!outliningEndRegion) {
+    for (auto *pred : nextBasicBlock->getPredecessors()) {
+      if (blocksToOutlineSet.count(pred) > 0) {
+        nextPreds.push_back(pred);
+      }
+    }
+    // the phi nodes would need the value of each outgoing branch
+    if (nextPreds.size() > 1 &&
+        std::any_of(nextBasicBlock->begin(), nextBasicBlock->end(),
+                    [](const Instruction &inst) {
+                      return dynamic_cast<const PhiNode *>(&inst) != nullptr;
+                    })) {
+      INFO("Do not support outlined region to have multiple outgoing "
+           "branches merged by phi nodes.");
+      return false;
+    }
+  }
 
   // get live variable going into the region
   LivenessAnalysis livenessAnalysis(f);
@@ -156,28 +277,79 @@ bool OutliningPass::outlineBasicBlocks(Vec<BasicBlock *> blocksToOutline,
         returnVars.insert(var);
       }
     }
-    if (returnVars.size() != 1) {
-      INFO(fmt::format(
-          "Do not support one outlined region to return {} variables",
-          returnVars.size()));
+    if (returnVars.empty() && !taggedResult) {
+      INFO("Do not support one outlined region to return 0 variables");
       return false;
     }
   }
 
-  auto *returnVariable = returnVars.empty() ? nullptr : *returnVars.begin();
+  // several live-out variables are returned as the fields of a STRUCT, named
+  // after the variables, a tagged result adds the exit taken and the value
+  // returned early
+  Vec<const Variable *> returnVariables(returnVars.begin(), returnVars.end());
+  std::sort(returnVariables.begin(), returnVariables.end(),
+            [](const Variable *v1, const Variable *v2) {
+              return v1->getName() < v2->getName();
+            });
+  Vec<Pair<String, Type>> structFields;
+  if (taggedResult) {
+    if (!(f.getReturnType().isNumeric() || f.getReturnType().isBlob())) {
+      INFO("Cannot return the result of the function as a STRUCT field.");
+      return false;
+    }
+    structFields.emplace_back(EXIT_TAG, Type::INT);
+    structFields.emplace_back(EXIT_VALUE, f.getReturnType());
+  }
+  Vec<Pair<String, Type>> returnFields;
+  Set<String> returnFieldNames = {EXIT_TAG, EXIT_VALUE};
+  for (auto *var : returnVariables) {
+    auto name = Function::getOriginalName(var->getName());
+    if ((returnVariables.size() > 1 || taggedResult) &&
+        (!returnFieldNames.insert(name).second ||
+         !(var->getType().isNumeric() || var->getType().isBlob()))) {
+      INFO(fmt::format("Cannot return variable {} as a STRUCT field.",
+                       var->getName()));
+      return false;
+    }
+    returnFields.emplace_back(name, var->getType());
+  }
+  structFields.insert(structFields.end(), returnFields.begin(),
+                      returnFields.end());
+  auto *returnVariable = returnVariables.size() == 1 && !taggedResult
+                             ? returnVariables.front()
+                             : nullptr;
 
   String newFunctionName =
       fmt::format("{}_outlined_{}", f.getFunctionName(), outlinedCount);
+  // only pass the values read by the outlined blocks, values that are merely
+  // live through the region stay in the caller
+  Set<const Variable *> usedInRegion;
+  for (auto *block : blocksToOutline) {
+    for (auto &inst : *block) {
+      for (auto *var : inst.getOperands()) {
+        usedInRegion.insert(var);
+      }
+    }
+  }
   Vec<const Variable *> newFunctionArgs;
   for (auto *var : liveIn) {
-    newFunctionArgs.push_back(var);
+    if (usedInRegion.count(var) > 0) {
+      newFunctionArgs.push_back(var);
+    }
   }
   std::sort(newFunctionArgs.begin(), newFunctionArgs.end(),
             [](const Variable *v1, const Variable *v2) {
               return v1->getName() < v2->getName();
             });
-  Type returnType =
-      outliningEndRegion ? f.getReturnType() : returnVariable->getType();
+  if (duckdb::optimizerPassOnMap.at("CostBasedOutlining") == true &&
+      !isWorthOutlining(blocksToOutline, newFunctionArgs.size())) {
+    INFO("Keeping the region in SQL.");
+    return false;
+  }
+
+  Type returnType = outliningEndRegion ? f.getReturnType()
+                    : returnVariable   ? returnVariable->getType()
+                                       : Type::makeStruct(structFields);
 
   Map<BasicBlock *, BasicBlock *> blockMap;
   auto newFunction = f.partialCloneAndRename(
@@ -186,8 +358,66 @@ bool OutliningPass::outlineBasicBlocks(Vec<BasicBlock *> blocksToOutline,
   if (!outliningEndRegion) {
     // add explicit return of the return variable to the end of the function
     auto *returnBlock = newFunction->makeBasicBlock("returnBlock");
-    returnBlock->addInstruction(Make<ReturnInst>(newFunction->bindExpression(
-        returnVariable->getName(), returnVariable->getType())));
+    if (taggedResult) {
+      // each exit sets its own copy of the fields to stay in SSA form, the
+      // SSA destruction merges them into the variables read by the STRUCT
+      // (Function::getOriginalName maps name__exitN back to name)
+      std::size_t exitCount = 0;
+      auto returnTagged = [&](BasicBlock *block,
+                              const Map<String, String> &values) {
+        Vec<String> fields;
+        for (auto &[name, type] : structFields) {
+          auto varName = fmt::format("{}__exit{}", name, exitCount);
+          newFunction->addVariable(varName, type, false);
+          block->addInstruction(Make<Assignment>(
+              newFunction->getBinding(varName),
+              newFunction->bindExpression(values.at(name), type)));
+          fields.push_back(fmt::format("{} := {}", name, varName));
+        }
+        ++exitCount;
+        block->addInstruction(Make<ReturnInst>(newFunction->bindExpression(
+            fmt::format("struct_pack({})", joinVector(fields, ", ")),
+            returnType, true, false)));
+      };
+
+      // the early returns are tagged with 1
+      for (auto *block : blocksToOutline) {
+        auto *newBlock = blockMap.at(block);
+        for (auto it = newBlock->begin(); it != newBlock->end(); ++it) {
+          if (auto *ret = dynamic_cast<const ReturnInst *>(&*it)) {
+            Map<String, String> values = {{EXIT_TAG, "1"},
+                                          {EXIT_VALUE,
+                                           ret->getExpr()->getRawSQL()}};
+            for (auto &[name, type] : returnFields) {
+              values.insert({name, getDefaultValue(type)});
+            }
+            newBlock->removeInst(it);
+            returnTagged(newBlock, values);
+            break;
+          }
+        }
+      }
+
+      // falling through to the next block is tagged with 0
+      Map<String, String> values = {
+          {EXIT_TAG, "0"}, {EXIT_VALUE, getDefaultValue(f.getReturnType())}};
+      for (std::size_t i = 0; i < returnVariables.size(); ++i) {
+        values.insert({returnFields[i].first, returnVariables[i]->getName()});
+      }
+      returnTagged(returnBlock, values);
+    } else if (returnVariable != nullptr) {
+      returnBlock->addInstruction(Make<ReturnInst>(newFunction->bindExpression(
+          returnVariable->getName(), returnVariable->getType())));
+    } else {
+      Vec<String> fields;
+      for (std::size_t i = 0; i < returnVariables.size(); ++i) {
+        fields.push_back(fmt::format("{} := {}", returnFields[i].first,
+                                     returnVariables[i]->getName()));
+      }
+      returnBlock->addInstruction(Make<ReturnInst>(newFunction->bindExpression(
+          fmt::format("struct_pack({})", joinVector(fields, ", ")),
+          returnType, true, false)));
+    }
 
     newFunction->renameBasicBlocks(nextBasicBlock, returnBlock);
     blockMap[nextBasicBlock] = returnBlock;
@@ -235,42 +465,92 @@ bool OutliningPass::outlineBasicBlocks(Vec<BasicBlock *> blocksToOutline,
   auto result = f.bindExpression(newFunctionName + "(" + args + ")",
                                  newFunction->getReturnType());
 
+  // a tagged result is dispatched on by new blocks in place of the region
+  const Variable *structVariable = nullptr;
+  BasicBlock *callBlock = nullptr;
+  Own<Region> dispatchRegion;
   if (outliningEndRegion) {
     auto retInst = Make<ReturnInst>(std::move(result));
     ASSERT(nextBasicBlock == nullptr, "Must not have a next basic block!");
     nextBasicBlock = f.makeBasicBlock();
     nextBasicBlock->addInstruction(std::move(retInst));
     nextBasicBlock->setRegion(Make<LeafRegion>(nextBasicBlock).release());
-  } else {
+  } else if (returnVariable != nullptr) {
     auto assign = Make<Assignment>(returnVariable, std::move(result));
     ASSERT(nextBasicBlock != nullptr, "NextBasicBlock cannot be nullptr!!");
     nextBasicBlock->insertBefore(nextBasicBlock->begin(), std::move(assign));
     nextBasicBlock->getRegion()->getParentRegion()->releaseNestedRegions();
+  } else {
+    ASSERT(nextBasicBlock != nullptr, "NextBasicBlock cannot be nullptr!!");
+    structVariable = f.createTempVariable(returnType, true);
+    if (taggedResult) {
+      // callBlock: struct = call, jmp dispatchBlock
+      // dispatchBlock: br exit_tag = 1 [returnBlock, nextBasicBlock]
+      // returnBlock: return exit_value
+      callBlock = f.makeBasicBlock();
+      auto *dispatchBlock = f.makeBasicBlock();
+      auto *returnBlock = f.makeBasicBlock();
+      callBlock->addInstruction(
+          Make<Assignment>(structVariable, std::move(result)));
+      callBlock->addInstruction(Make<BranchInst>(dispatchBlock));
+      returnBlock->addInstruction(Make<ReturnInst>(f.bindExpression(
+          fmt::format("struct_extract({}, '{}')", structVariable->getName(),
+                      EXIT_VALUE),
+          f.getReturnType())));
+      nextBasicBlock->replacePredecessor(nextPreds.front(), dispatchBlock);
+      dispatchBlock->addInstruction(Make<BranchInst>(
+          returnBlock, nextBasicBlock,
+          f.bindExpression(fmt::format("struct_extract({}, '{}') = 1",
+                                       structVariable->getName(), EXIT_TAG),
+                           Type::BOOLEAN)));
+      dispatchRegion = Make<ConditionalRegion>(dispatchBlock,
+                                               Make<LeafRegion>(returnBlock));
+    } else {
+      nextBasicBlock->insertBefore(
+          nextBasicBlock->begin(),
+          Make<Assignment>(structVariable, std::move(result)));
+    }
+
+    // unpack the fields of the returned STRUCT
+    auto it = nextBasicBlock->begin();
+    if (!taggedResult) {
+      ++it;
+    }
+    for (std::size_t i = 0; i < returnVariables.size(); ++i) {
+      auto *var = returnVariables[i];
+      it = nextBasicBlock->insertBefore(
+          it,
+          Make<Assignment>(var, f.bindExpression(
+                                    fmt::format("struct_extract({}, '{}')",
+                                                structVariable->getName(),
+                                                returnFields[i].first),
+                                    var->getType())));
+      ++it;
+    }
+    nextBasicBlock->getRegion()->getParentRegion()->releaseNestedRegions();
   }
 
   auto &preds = regionHeader->getPredecessors();
   ASSERT(preds.size() == 1, "Must have exactly one predecessor for region!");
   auto *pred = preds.front();
 
-  // get the predecessor of nextBasicBlock that is in the region
-  BasicBlock *nextPred = nullptr;
-  Set<BasicBlock *> blocksToOutlineSet;
-  for (auto *block : blocksToOutline) {
-    blocksToOutlineSet.insert(block);
+  // the other outgoing branches of the region are merged into one
+  for (std::size_t i = 1; i < nextPreds.size(); ++i) {
+    nextBasicBlock->removePredecessor(nextPreds[i]);
   }
-  for (auto *pred : nextBasicBlock->getPredecessors()) {
-    if (blocksToOutlineSet.count(pred) > 0) {
-      if (nextPred != nullptr) {
-        INFO("Do not support outlined region to have multiple outgoing "
-             "branches.");
-        return false;
-      }
-      nextPred = pred;
-    }
+  if (callBlock != nullptr) {
+    pred->renameBasicBlock(regionHeader, callBlock, nullptr);
+  } else {
+    pred->renameBasicBlock(regionHeader, nextBasicBlock,
+                           nextPreds.empty() ? nullptr : nextPreds.front());
   }
-  pred->renameBasicBlock(regionHeader, nextBasicBlock, nextPred);
 
-  auto *replacement = nextBasicBlock->getRegion();
+  Region *replacement = nextBasicBlock->getRegion();
+  if (callBlock != nullptr) {
+    replacement = Make<SequentialRegion>(callBlock, std::move(dispatchRegion),
+                                         Own<Region>(replacement))
+                      .release();
+  }
   auto *currentRegion = regionHeader->getRegion();
   auto *parentRegion = currentRegion->getParentRegion();
 
@@ -290,6 +570,73 @@ bool OutliningPass::outlineBasicBlocks(Vec<BasicBlock *> blocksToOutline,
   return false;
 }
 
+/**
+ * Moves the scalar lookups of the header in front of the queued blocks, so the
+ * code before and after them is outlined into a single function. The lookups
+ * go to the end of the only predecessor of the queued blocks, which must only
+ * lead to them, and every path through the queued blocks must reach the
+ * header, so the lookups run exactly when they did before
+ */
+bool OutliningPass::hoistQueries(BasicBlock *header,
+                                 const Vec<BasicBlock *> &queuedBlocks,
+                                 Function &f) const {
+  auto *firstBlock = queuedBlocks.front();
+  if (firstBlock->getPredecessors().size() != 1) {
+    return false;
+  }
+  auto *insertBlock = firstBlock->getPredecessors().front();
+  if (insertBlock == f.getEntryBlock() ||
+      insertBlock->getSuccessors().size() != 1) {
+    return false;
+  }
+
+  Set<const BasicBlock *> queued(queuedBlocks.begin(), queuedBlocks.end());
+  Set<const Variable *> defined;
+  for (auto *block : queuedBlocks) {
+    // don't run the lookups on paths that have already returned or that leave
+    // the queued blocks elsewhere than through the header
+    if (block == insertBlock || block->getSuccessors().empty()) {
+      return false;
+    }
+    for (auto *succ : block->getSuccessors()) {
+      if (succ != header && queued.count(succ) == 0) {
+        return false;
+      }
+    }
+    for (auto &inst : *block) {
+      if (auto *def = inst.getResultOperand()) {
+        defined.insert(def);
+      }
+    }
+  }
+  for (auto &inst : *header) {
+    if (inst.hasSelect()) {
+      auto operands = inst.getOperands();
+      if (!dynamic_cast<const Assignment *>(&inst) ||
+          std::any_of(operands.begin(), operands.end(),
+                      [&](const Variable *var) {
+                        return defined.count(var) > 0;
+                      })) {
+        return false;
+      }
+    } else if (auto *def = inst.getResultOperand()) {
+      defined.insert(def);
+    }
+  }
+
+  for (auto it = header->begin(); it != header->end();) {
+    if (it->hasSelect()) {
+      insertBlock->insertBeforeTerminator(it->clone());
+      it = header->removeInst(it);
+    } else {
+      ++it;
+    }
+  }
+  INFO(fmt::format("Hoisted the queries of {} above {}.", header->getLabel(),
+                   firstBlock->getLabel()));
+  return true;
+}
+
 bool OutliningPass::runOnRegion(SelectRegions &containsSelect,
                                 const Region *region, Function &f,
                                 Vec<BasicBlock *> &queuedBlocks,
@@ -341,7 +688,17 @@ bool OutliningPass::runOnRegion(SelectRegions &containsSelect,
       // sequential region is an exception because other part of the region
       // does not affect regions inside it being outlined
       auto *header = sequentialRegion->getHeader();
-      if (!header->hasSelect()) {
+      // queries that don't depend on the queued blocks can run before them,
+      // the code around the queries then becomes one outlined function
+      bool hoisted = false;
+      if (header->hasSelect() && !queuedBlocks.empty() &&
+          fallthroughStart == (size_t)-1 &&
+          duckdb::optimizerPassOnMap.at("CoalesceOutlinedRegions") == true) {
+        hoisted = hoistQueries(header, queuedBlocks, f);
+        ASSERT(!hoisted || !header->hasSelect(),
+               "Hoisting must move every query of the header!");
+      }
+      if (hoisted || !header->hasSelect()) {
         queueBlock(header);
         fallthroughStart = -1;
       } else {
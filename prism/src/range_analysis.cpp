@@ -0,0 +1,414 @@
+#include "range_analysis.hpp"
+#include "dominator_analysis.hpp"
+#include "duckdb/common/enums/expression_type.hpp"
+#include "duckdb/planner/expression/bound_cast_expression.hpp"
+#include "duckdb/planner/expression/bound_comparison_expression.hpp"
+#include "duckdb/planner/expression/bound_conjunction_expression.hpp"
+#include "duckdb/planner/expression/bound_constant_expression.hpp"
+#include "duckdb/planner/expression/bound_operator_expression.hpp"
+
+using duckdb::BoundCastExpression;
+using duckdb::BoundComparisonExpression;
+using duckdb::BoundConjunctionExpression;
+using duckdb::BoundConstantExpression;
+using duckdb::BoundFunctionExpression;
+using duckdb::BoundOperatorExpression;
+using duckdb::Expression;
+using duckdb::ExpressionClass;
+using duckdb::ExpressionType;
+using duckdb::LogicalTypeId;
+
+Opt<ValueRange> RangeAnalysis::getTypeRange(const duckdb::LogicalType &type) {
+  switch (type.id()) {
+  case LogicalTypeId::TINYINT:
+    return ValueRange::ofCppType("int8_t");
+  case LogicalTypeId::SMALLINT:
+    return ValueRange::ofCppType("int16_t");
+  case LogicalTypeId::INTEGER:
+    return ValueRange::ofCppType("int32_t");
+  case LogicalTypeId::BIGINT:
+    return ValueRange::ofCppType("int64_t");
+  case LogicalTypeId::UTINYINT:
+    return ValueRange::ofCppType("uint8_t");
+  case LogicalTypeId::USMALLINT:
+    return ValueRange::ofCppType("uint16_t");
+  case LogicalTypeId::UINTEGER:
+    return ValueRange::ofCppType("uint32_t");
+  default:
+    return std::nullopt;
+  }
+}
+
+/**
+ * the variable name an expression refers to, looking through widening casts
+ */
+static Opt<String> getReferencedName(const Expression &expr) {
+  switch (expr.GetExpressionClass()) {
+  case ExpressionClass::BOUND_COLUMN_REF:
+  case ExpressionClass::BOUND_REF:
+    return toLower(expr.GetName());
+  case ExpressionClass::BOUND_CAST: {
+    auto &cast = expr.Cast<BoundCastExpression>();
+    auto source = RangeAnalysis::getTypeRange(cast.child->return_type);
+    auto target = RangeAnalysis::getTypeRange(cast.return_type);
+    if (source && target && source->fitsIn(*target)) {
+      return getReferencedName(*cast.child);
+    }
+    return std::nullopt;
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+Opt<ValueRange>
+RangeAnalysis::evaluateUnchecked(const BoundFunctionExpression &expr,
+                                 const RangeLookup &lookup) {
+  Vec<ValueRange> args;
+  for (auto &child : expr.children) {
+    auto range = evaluate(*child, lookup);
+    if (!range) {
+      return std::nullopt;
+    }
+    args.push_back(*range);
+  }
+  auto &name = expr.function.name;
+  if (name == "+" && args.size() == 2) {
+    return args[0].add(args[1]);
+  } else if (name == "+" && args.size() == 1) {
+    return args[0];
+  } else if (name == "-" && args.size() == 2) {
+    return args[0].subtract(args[1]);
+  } else if (name == "-" && args.size() == 1) {
+    return args[0].negate();
+  } else if (name == "*" && args.size() == 2) {
+    return args[0].multiply(args[1]);
+  }
+  return std::nullopt;
+}
+
+Opt<ValueRange> RangeAnalysis::evaluate(const Expression &expr,
+                                        const RangeLookup &lookup) {
+  auto typeRange = getTypeRange(expr.return_type);
+  if (!typeRange) {
+    return std::nullopt;
+  }
+
+  // a result outside of the type range raises an error (overflow or cast),
+  // so clamping to the type range is always sound
+  auto clamp = [&](const Opt<ValueRange> &range) {
+    if (!range) {
+      return *typeRange;
+    }
+    auto clamped = range->intersect(*typeRange);
+    return clamped ? *clamped : *typeRange;
+  };
+
+  switch (expr.GetExpressionClass()) {
+  case ExpressionClass::BOUND_CONSTANT: {
+    auto &constant = expr.Cast<BoundConstantExpression>();
+    if (constant.value.IsNull()) {
+      return typeRange;
+    }
+    auto value = constant.value.GetValue<int64_t>();
+    return ValueRange(value, value);
+  }
+  case ExpressionClass::BOUND_COLUMN_REF:
+  case ExpressionClass::BOUND_REF:
+    return clamp(lookup(toLower(expr.GetName())));
+  case ExpressionClass::BOUND_CAST: {
+    auto &cast = expr.Cast<BoundCastExpression>();
+    return clamp(evaluate(*cast.child, lookup));
+  }
+  case ExpressionClass::BOUND_FUNCTION:
+    return clamp(
+        evaluateUnchecked(expr.Cast<BoundFunctionExpression>(), lookup));
+  default:
+    return typeRange;
+  }
+}
+
+/**
+ * the conditions (and whether they hold) of the branches that must have been
+ * taken to reach block, i.e. edges into a single-predecessor dominator
+ */
+Vec<RangeAnalysis::Guard>
+RangeAnalysis::getGuards(BasicBlock *block,
+                         const Map<BasicBlock *, BasicBlock *> &idom) const {
+  Vec<Guard> guards;
+  auto *current = block;
+  while (current != nullptr) {
+    auto &preds = current->getPredecessors();
+    if (preds.size() == 1) {
+      auto *pred = preds.front();
+      auto *branch = dynamic_cast<const BranchInst *>(pred->getTerminator());
+      if (branch != nullptr && branch->isConditional() &&
+          branch->getIfTrue() != branch->getIfFalse() &&
+          !branch->getCond()->isSQLExpression()) {
+        auto *plan = branch->getCond()->getLogicalPlan();
+        guards.emplace_back(plan->expressions[0].get(),
+                            branch->getIfTrue() == current);
+      }
+    }
+    current = idom.find(current) == idom.end() ? nullptr : idom.at(current);
+  }
+  return guards;
+}
+
+Opt<ValueRange> RangeAnalysis::refine(const Variable *var, ValueRange range,
+                                      const Expression &cond, bool truth,
+                                      const RangeLookup &lookup) const {
+  auto one = ValueRange(1, 1);
+  switch (cond.GetExpressionClass()) {
+  case ExpressionClass::BOUND_CONJUNCTION: {
+    auto &conjunction = cond.Cast<BoundConjunctionExpression>();
+    // only (a AND b) being true or (a OR b) being false constrains each child
+    bool isAnd = conjunction.GetExpressionType() ==
+                 ExpressionType::CONJUNCTION_AND;
+    if (isAnd != truth) {
+      return range;
+    }
+    for (auto &child : conjunction.children) {
+      auto refined = refine(var, range, *child, truth, lookup);
+      if (!refined) {
+        return std::nullopt;
+      }
+      range = *refined;
+    }
+    return range;
+  }
+  case ExpressionClass::BOUND_OPERATOR: {
+    auto &op = cond.Cast<BoundOperatorExpression>();
+    if (op.GetExpressionType() == ExpressionType::OPERATOR_NOT) {
+      return refine(var, range, *op.children[0], !truth, lookup);
+    }
+    return range;
+  }
+  case ExpressionClass::BOUND_COMPARISON: {
+    auto &comparison = cond.Cast<BoundComparisonExpression>();
+    auto type = comparison.GetExpressionType();
+    const Expression *other = nullptr;
+    if (getReferencedName(*comparison.left) == var->getName()) {
+      other = comparison.right.get();
+    } else if (getReferencedName(*comparison.right) == var->getName()) {
+      other = comparison.left.get();
+      type = duckdb::FlipComparisonExpression(type);
+    } else {
+      return range;
+    }
+    if (!truth) {
+      type = duckdb::NegateComparisonExpression(type);
+    }
+    auto otherRange = evaluate(*other, lookup);
+    if (!otherRange) {
+      return range;
+    }
+    auto min = std::numeric_limits<int64_t>::min();
+    auto max = std::numeric_limits<int64_t>::max();
+    // a strict comparison moves the bound it sets by one (saturating), the
+    // other end of the range is left unbounded
+    auto upper = otherRange->getUpper();
+    auto lower = otherRange->getLower();
+    switch (type) {
+    case ExpressionType::COMPARE_LESSTHAN:
+      return range.intersect(ValueRange(min, upper == min ? min : upper - 1));
+    case ExpressionType::COMPARE_LESSTHANOREQUALTO:
+      return range.intersect(ValueRange(min, upper));
+    case ExpressionType::COMPARE_GREATERTHAN:
+      return range.intersect(ValueRange(lower == max ? max : lower + 1, max));
+    case ExpressionType::COMPARE_GREATERTHANOREQUALTO:
+      return range.intersect(ValueRange(lower, max));
+    case ExpressionType::COMPARE_EQUAL:
+      return range.intersect(*otherRange);
+    default:
+      return range;
+    }
+  }
+  default:
+    return range;
+  }
+}
+
+void RangeAnalysis::runAnalysis() {
+  variableRanges = Make<VariableRanges>();
+
+  // recover the immediate dominators from the dominator tree
+  DominatorAnalysis dominatorAnalysis(f);
+  dominatorAnalysis.runAnalysis();
+  const auto &dominatorTree = dominatorAnalysis.getDominatorTree();
+  Map<BasicBlock *, BasicBlock *> idom;
+  for (auto &block : f) {
+    for (auto &child : dominatorTree->getChildren(block.getLabel())) {
+      idom.insert({f.getBlockFromLabel(child), &block});
+    }
+  }
+
+  auto integerRange = [](const Variable *var) -> Opt<ValueRange> {
+    if (var->getType().isDecimal()) {
+      return std::nullopt;
+    }
+    return ValueRange::ofCppType(var->getType().getCppType());
+  };
+
+  // arguments and variables without a definition can hold any value
+  Map<const Variable *, std::size_t> defCount;
+  for (auto &block : f) {
+    for (auto &inst : block) {
+      if (auto *var = inst.getResultOperand()) {
+        ++defCount[var];
+      }
+    }
+  }
+  for (auto *var : f.getAllVariables()) {
+    auto range = integerRange(var);
+    if (range && defCount[var] == 0) {
+      variableRanges->setRange(var, *range);
+    }
+  }
+
+  // the range of a variable as seen from a block, a variable that has no
+  // range yet (bottom) is reported through sawBottom
+  bool sawBottom = false;
+  auto lookupAt = [&](BasicBlock *block) -> RangeLookup {
+    return [&, block](const String &name) -> Opt<ValueRange> {
+      if (!f.hasBinding(name)) {
+        return std::nullopt;
+      }
+      auto *var = f.getBinding(name);
+      auto range = variableRanges->getRange(var);
+      if (!range) {
+        sawBottom = sawBottom || integerRange(var).has_value();
+        return std::nullopt;
+      }
+      // guards only constrain a variable that is never redefined
+      if (defCount[var] > 1) {
+        return range;
+      }
+      RangeLookup unguarded = [&](const String &name) -> Opt<ValueRange> {
+        if (!f.hasBinding(name)) {
+          return std::nullopt;
+        }
+        return variableRanges->getRange(f.getBinding(name));
+      };
+      for (auto &[cond, truth] : getGuards(block, idom)) {
+        auto refined = refine(var, *range, *cond, truth, unguarded);
+        if (!refined) {
+          // the block is unreachable with these guards
+          return range;
+        }
+        range = refined;
+      }
+      return range;
+    };
+  };
+
+  // the range of the value defined by an instruction under the current ranges
+  // of its operands, std::nullopt if it can't be computed yet
+  auto transfer = [&](BasicBlock &block, const Instruction &inst,
+                      const ValueRange &typeRange) -> Opt<ValueRange> {
+    Opt<ValueRange> newRange;
+    if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+      sawBottom = false;
+      auto *plan = assign->getRHS()->getLogicalPlan();
+      newRange = assign->getRHS()->isSQLExpression()
+                     ? typeRange
+                     : evaluate(*plan->expressions[0], lookupAt(&block));
+      if (sawBottom) {
+        return std::nullopt;
+      }
+    } else if (auto *phi = dynamic_cast<const PhiNode *>(&inst)) {
+      auto args = phi->getRHS();
+      auto &preds = block.getPredecessors();
+      for (std::size_t i = 0; i < args.size() && i < preds.size(); ++i) {
+        sawBottom = false;
+        auto *plan = args[i]->getLogicalPlan();
+        auto argRange =
+            args[i]->isSQLExpression()
+                ? typeRange
+                : evaluate(*plan->expressions[0], lookupAt(preds[i]));
+        if (sawBottom || !argRange) {
+          continue;
+        }
+        newRange = newRange ? newRange->join(*argRange) : *argRange;
+      }
+      if (!newRange) {
+        return std::nullopt;
+      }
+    }
+    // storing a value outside of the variable's type raises a cast error
+    newRange = newRange ? newRange->intersect(typeRange) : typeRange;
+    return newRange ? *newRange : typeRange;
+  };
+
+  // iterate to a fixpoint, widening the bounds of variables that keep growing
+  // (loops) to the bounds of their type
+  Map<const Variable *, std::size_t> updates;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto &block : f) {
+      for (auto &inst : block) {
+        auto *var = inst.getResultOperand();
+        auto typeRange = var == nullptr ? std::nullopt : integerRange(var);
+        if (!typeRange) {
+          continue;
+        }
+        auto newRange = transfer(block, inst, *typeRange);
+        if (!newRange) {
+          continue;
+        }
+
+        auto oldRange = variableRanges->getRange(var);
+        auto joined = oldRange ? oldRange->join(*newRange) : *newRange;
+        if (oldRange && *oldRange == joined) {
+          continue;
+        }
+        if (++updates[var] > WIDENING_THRESHOLD) {
+          joined = ValueRange(joined.getLower() < oldRange->getLower()
+                                  ? typeRange->getLower()
+                                  : joined.getLower(),
+                              joined.getUpper() > oldRange->getUpper()
+                                  ? typeRange->getUpper()
+                                  : joined.getUpper());
+        }
+        variableRanges->setRange(var, joined);
+        changed = true;
+      }
+    }
+  }
+
+  // narrow the widened ranges again, the ranges are a post-fixpoint so
+  // applying the definitions once more only removes values that can't occur
+  // (e.g. the guard of a loop bounds the counter that was widened)
+  for (std::size_t round = 0; round < NARROWING_ROUNDS; ++round) {
+    changed = false;
+    for (auto &block : f) {
+      for (auto &inst : block) {
+        auto *var = inst.getResultOperand();
+        auto typeRange = var == nullptr ? std::nullopt : integerRange(var);
+        auto oldRange = var == nullptr ? std::nullopt
+                                       : variableRanges->getRange(var);
+        if (!typeRange || !oldRange) {
+          continue;
+        }
+        auto newRange = transfer(block, inst, *typeRange);
+        auto narrowed = newRange ? oldRange->intersect(*newRange) : oldRange;
+        if (narrowed && *narrowed != *oldRange) {
+          variableRanges->setRange(var, *narrowed);
+          changed = true;
+        }
+      }
+    }
+    if (!changed) {
+      break;
+    }
+  }
+
+  // definitions that were never reached can hold any value
+  for (auto *var : f.getAllVariables()) {
+    auto range = integerRange(var);
+    if (range && !variableRanges->getRange(var)) {
+      variableRanges->setRange(var, *range);
+    }
+  }
+}
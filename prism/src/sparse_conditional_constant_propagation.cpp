@@ -0,0 +1,303 @@
+#include "sparse_conditional_constant_propagation.hpp"
+#include "duckdb/planner/expression/bound_constant_expression.hpp"
+#include "instructions.hpp"
+#include "region.hpp"
+
+using LatticeValue = SparseConditionalConstantPropagationPass::LatticeValue;
+using Kind = LatticeValue::Kind;
+
+static const LatticeValue UNDEFINED = {Kind::UNDEFINED, ""};
+static const LatticeValue OVERDEFINED = {Kind::OVERDEFINED, ""};
+
+LatticeValue
+SparseConditionalConstantPropagationPass::getValue(const Variable *var) const {
+  if (lattice.find(var) == lattice.end()) {
+    return UNDEFINED;
+  }
+  return lattice.at(var);
+}
+
+/**
+ * Lower the lattice value of var, returns true if it changed
+ */
+bool SparseConditionalConstantPropagationPass::setValue(
+    const Variable *var, const LatticeValue &value) {
+  auto oldValue = getValue(var);
+  if (value.kind == Kind::UNDEFINED || oldValue.kind == Kind::OVERDEFINED) {
+    return false;
+  }
+  if (oldValue.kind == Kind::CONSTANT && value.kind == Kind::CONSTANT &&
+      oldValue.constant == value.constant) {
+    return false;
+  }
+  lattice.insert_or_assign(var, oldValue.kind == Kind::CONSTANT ? OVERDEFINED
+                                                                : value);
+  constantExpressions.erase(var);
+  return true;
+}
+
+const SelectExpression *
+SparseConditionalConstantPropagationPass::getConstantExpression(
+    Function &f, const Variable *var) {
+  if (constantExpressions.find(var) == constantExpressions.end()) {
+    constantExpressions.insert(
+        {var, f.bindExpression("(" + getValue(var).constant + ")",
+                               var->getType())});
+  }
+  return constantExpressions.at(var).get();
+}
+
+/**
+ * Substitute the constant operands and let DuckDB fold the expression
+ */
+LatticeValue SparseConditionalConstantPropagationPass::evaluate(
+    Function &f, const SelectExpression *expr) {
+  if (!expr->isPure()) {
+    return OVERDEFINED;
+  }
+  Map<const Variable *, const SelectExpression *> oldToNew;
+  for (auto *var : expr->getUsedVariables()) {
+    auto value = getValue(var);
+    if (value.kind != Kind::CONSTANT) {
+      return value;
+    }
+    oldToNew.insert({var, getConstantExpression(f, var)});
+  }
+  auto folded = oldToNew.empty() ? expr->clone()
+                                 : f.replaceVarWithExpression(expr, oldToNew);
+  auto &result = folded->getLogicalPlan()->expressions[0];
+  if (result->GetExpressionClass() !=
+      duckdb::ExpressionClass::BOUND_CONSTANT) {
+    return OVERDEFINED;
+  }
+  auto &constant = result->Cast<duckdb::BoundConstantExpression>();
+  return {Kind::CONSTANT, constant.value.ToSQLString()};
+}
+
+bool SparseConditionalConstantPropagationPass::markEdge(BasicBlock *from,
+                                                        BasicBlock *to) {
+  executable.insert(to);
+  return executableEdges[from].insert(to).second;
+}
+
+/**
+ * Rebuild the phi nodes of block after its predecessors changed from oldPreds
+ */
+static void updatePhis(BasicBlock *block, const Vec<BasicBlock *> &oldPreds) {
+  auto &newPreds = block->getPredecessors();
+  for (auto it = block->begin(); it != block->end(); ++it) {
+    auto *phi = dynamic_cast<const PhiNode *>(&*it);
+    if (phi == nullptr) {
+      continue;
+    }
+    auto args = phi->getRHS();
+    VecOwn<SelectExpression> newArgs;
+    for (auto *pred : newPreds) {
+      auto predIt = std::find(oldPreds.begin(), oldPreds.end(), pred);
+      ASSERT(predIt != oldPreds.end(),
+             "Phi node has no argument for a new predecessor!");
+      newArgs.emplace_back(
+          args[std::distance(oldPreds.begin(), predIt)]->clone());
+    }
+    it = block->replaceInst(it,
+                            Make<PhiNode>(phi->getLHS(), std::move(newArgs)));
+  }
+}
+
+/**
+ * Turn the conditional branch of header into a jump to taken and remove the
+ * nested region behind dead, only done when that region is unreachable
+ * otherwise
+ */
+bool SparseConditionalConstantPropagationPass::removeDeadBranch(
+    Function &f, BasicBlock *header, BasicBlock *taken, BasicBlock *dead) {
+  auto *region = dynamic_cast<ConditionalRegion *>(header->getRegion());
+  if (region == nullptr || region->getHeader() != header || taken == dead) {
+    return false;
+  }
+  auto *deadRegion = dead->getRegion();
+  if (deadRegion == nullptr || deadRegion->getHeader() != dead ||
+      deadRegion->getParentRegion() != region) {
+    return false;
+  }
+  auto deadBlocks = deadRegion->getBasicBlocks();
+  Set<BasicBlock *> deadSet(deadBlocks.begin(), deadBlocks.end());
+
+  // the dead region must not be reachable through any other edge
+  Set<BasicBlock *> visited = {f.getEntryBlock()};
+  Vec<BasicBlock *> worklist = {f.getEntryBlock()};
+  while (!worklist.empty()) {
+    auto *block = worklist.back();
+    worklist.pop_back();
+    for (auto *succ : block->getSuccessors()) {
+      if (block == header && succ == dead) {
+        continue;
+      }
+      if (deadSet.count(succ) > 0) {
+        return false;
+      }
+      if (visited.insert(succ).second) {
+        worklist.push_back(succ);
+      }
+    }
+  }
+
+  // remember the predecessors of the live blocks next to the removed edges
+  Map<BasicBlock *, Vec<BasicBlock *>> oldPreds;
+  deadBlocks.push_back(header);
+  for (auto *block : deadBlocks) {
+    for (auto *succ : block->getSuccessors()) {
+      if (deadSet.count(succ) == 0) {
+        oldPreds.insert({succ, succ->getPredecessors()});
+      }
+    }
+  }
+  deadBlocks.pop_back();
+
+  header->getTerminator()->replaceWith(Make<BranchInst>(taken), true);
+  for (auto *block : deadBlocks) {
+    for (auto it = block->begin(); it != block->end();) {
+      it = block->removeInst(it);
+    }
+  }
+  for (auto *block : deadBlocks) {
+    constantBranches.erase(block);
+    f.removeBasicBlock(block);
+  }
+  for (auto &[block, preds] : oldPreds) {
+    updatePhis(block, preds);
+  }
+
+  // the conditional region becomes a sequence of the header and the region
+  // of the edge that is taken (if it is nested in the conditional region)
+  auto *parentRegion = region->getParentRegion();
+  auto *takenRegion = taken->getRegion();
+  Own<Region> newRegion;
+  if (takenRegion != nullptr && takenRegion->getParentRegion() == region) {
+    newRegion = Make<SequentialRegion>(
+        header, region->releaseNestedRegion(takenRegion));
+  } else {
+    newRegion = Make<LeafRegion>(header);
+  }
+  newRegion->setMetadata(region->getMetadata());
+  parentRegion->replaceNestedRegion(region, newRegion.release());
+  return true;
+}
+
+bool SparseConditionalConstantPropagationPass::runOnFunction(Function &f) {
+  bool changed = false;
+  lattice.clear();
+  constantExpressions.clear();
+  executable.clear();
+  executableEdges.clear();
+  constantBranches.clear();
+
+  // arguments and variables that are never defined can hold any value
+  Set<const Variable *> defined;
+  for (auto &block : f) {
+    for (auto &inst : block) {
+      if (auto *var = inst.getResultOperand()) {
+        defined.insert(var);
+      }
+    }
+  }
+  for (auto *var : f.getAllVariables()) {
+    if (defined.count(var) == 0) {
+      lattice.insert({var, OVERDEFINED});
+    }
+  }
+
+  // iterate to a fixpoint, only visiting blocks reached by executable edges
+  executable.insert(f.getEntryBlock());
+  bool updated = true;
+  while (updated) {
+    updated = false;
+    for (auto &block : f) {
+      if (executable.count(&block) == 0) {
+        continue;
+      }
+      for (auto &inst : block) {
+        if (auto *phi = dynamic_cast<const PhiNode *>(&inst)) {
+          auto args = phi->getRHS();
+          auto &preds = block.getPredecessors();
+          auto value = UNDEFINED;
+          for (std::size_t i = 0; i < args.size(); ++i) {
+            if (executableEdges[preds[i]].count(&block) == 0) {
+              continue;
+            }
+            auto argValue = evaluate(f, args[i]);
+            if (argValue.kind == Kind::UNDEFINED) {
+              continue;
+            }
+            if (argValue.kind == Kind::OVERDEFINED ||
+                (value.kind == Kind::CONSTANT &&
+                 value.constant != argValue.constant)) {
+              value = OVERDEFINED;
+              break;
+            }
+            value = argValue;
+          }
+          updated = setValue(phi->getLHS(), value) || updated;
+        } else if (auto *assign = dynamic_cast<const Assignment *>(&inst)) {
+          updated =
+              setValue(assign->getLHS(), evaluate(f, assign->getRHS())) ||
+              updated;
+        } else if (auto *branch = dynamic_cast<const BranchInst *>(&inst)) {
+          if (branch->isUnconditional()) {
+            updated = markEdge(&block, branch->getIfTrue()) || updated;
+            continue;
+          }
+          auto cond = evaluate(f, branch->getCond());
+          if (cond.kind == Kind::CONSTANT) {
+            // a NULL condition takes the false edge
+            auto *taken = toLower(cond.constant) == "true"
+                              ? branch->getIfTrue()
+                              : branch->getIfFalse();
+            constantBranches.insert_or_assign(&block, taken);
+            updated = markEdge(&block, taken) || updated;
+          } else if (cond.kind == Kind::OVERDEFINED) {
+            constantBranches.erase(&block);
+            updated = markEdge(&block, branch->getIfTrue()) || updated;
+            updated = markEdge(&block, branch->getIfFalse()) || updated;
+          }
+        }
+      }
+    }
+  }
+
+  // replace the definitions of constants, InstructionElimination propagates
+  // them into the uses
+  for (auto &block : f) {
+    if (&block == f.getEntryBlock() || executable.count(&block) == 0) {
+      continue;
+    }
+    for (auto it = block.begin(); it != block.end(); ++it) {
+      auto *var = it->getResultOperand();
+      if (var == nullptr || getValue(var).kind != Kind::CONSTANT) {
+        continue;
+      }
+      auto *assign = dynamic_cast<const Assignment *>(&*it);
+      if (assign != nullptr && assign->getRHS()->isTrivial()) {
+        continue;
+      }
+      it = block.replaceInst(
+          it, Make<Assignment>(var, getConstantExpression(f, var)->clone()));
+      changed = true;
+    }
+  }
+
+  // remove the branches that are never taken
+  while (!constantBranches.empty()) {
+    auto [header, taken] = *constantBranches.begin();
+    constantBranches.erase(header);
+    auto *branch = dynamic_cast<const BranchInst *>(header->getTerminator());
+    if (branch == nullptr || branch->isUnconditional()) {
+      continue;
+    }
+    auto *dead = branch->getIfTrue() == taken ? branch->getIfFalse()
+                                              : branch->getIfTrue();
+    changed = removeDeadBranch(f, header, taken, dead) || changed;
+  }
+
+  return changed;
+}
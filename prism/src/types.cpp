@@ -46,6 +46,9 @@ std::ostream &operator<<(std::ostream &os, DuckdbTypeTag tag) {
   case DuckdbTypeTag::SMALLINT:
     os << "SMALLINT";
     break;
+  case DuckdbTypeTag::STRUCT:
+    os << "STRUCT";
+    break;
   case DuckdbTypeTag::TIME:
     os << "TIME";
     break;
@@ -131,6 +134,14 @@ duckdb::LogicalType Type::getDuckDBLogicalType() const {
       return duckdb::LogicalType::SMALLINT;
     }
     {
+    case DuckdbTypeTag::STRUCT:
+      duckdb::child_list_t<duckdb::LogicalType> children;
+      for (auto &[name, fieldType] : getFields()) {
+        children.emplace_back(name, fieldType.getDuckDBLogicalType());
+      }
+      return duckdb::LogicalType::STRUCT(children);
+    }
+    {
     case DuckdbTypeTag::TIME:
       return duckdb::LogicalType::TIME;
     }
@@ -219,6 +230,9 @@ std::ostream &operator<<(std::ostream &os, CppTypeTag tag) {
   case CppTypeTag::DATE_T:
     os << "date_t";
     break;
+  case CppTypeTag::VALUE:
+    os << "Value";
+    break;
   default:
     os << "UNKNOWN";
   }
@@ -282,9 +296,11 @@ DuckdbTypeTag Type::lookupDuckdbTag(PostgresTypeTag pgTag) const {
   case PostgresTypeTag::LONG:
     return DuckdbTypeTag::BIGINT;
   case PostgresTypeTag::NUMERIC:
-    return DuckdbTypeTag::DOUBLE;
+    return DuckdbTypeTag::DECIMAL;
   case PostgresTypeTag::REAL:
     return DuckdbTypeTag::REAL;
+  case PostgresTypeTag::RECORD:
+    return DuckdbTypeTag::STRUCT;
   case PostgresTypeTag::SHORT:
     return DuckdbTypeTag::SMALLINT;
   case PostgresTypeTag::SIGNED:
@@ -358,6 +374,8 @@ CppTypeTag Type::lookupCppTag(DuckdbTypeTag duckdbTag, Opt<int> width,
     return CppTypeTag::FLOAT;
   case DuckdbTypeTag::SMALLINT:
     return CppTypeTag::INT16_T;
+  case DuckdbTypeTag::STRUCT:
+    return CppTypeTag::VALUE;
   case DuckdbTypeTag::TIME:
     return CppTypeTag::INT32_T;
   case DuckdbTypeTag::TIMESTAMP:
@@ -385,6 +403,12 @@ CppTypeTag Type::lookupCppTag(DuckdbTypeTag duckdbTag, Opt<int> width,
 void Type::print(std::ostream &os) const {
   if (isDecimal()) {
     os << fmt::format("DECIMAL({}, {})", *width, *scale);
+  } else if (isStruct()) {
+    Vec<String> fields;
+    for (auto &[name, fieldType] : getFields()) {
+      fields.push_back(name + " " + fieldType.getDuckDBType());
+    }
+    os << fmt::format("STRUCT({})", joinVector(fields, ", "));
   } else {
     std::stringstream ss;
     ss << duckdbTag;
@@ -443,11 +467,15 @@ PostgresTypeTag Type::getPostgresTag(const String &type) {
       {"VARBINARY", PostgresTypeTag::VARBINARY},
       {"VARCHAR", PostgresTypeTag::VARCHAR}};
 
-  // Edge case for DECIMAL(width,scale)
+  // Edge case for DECIMAL(width,scale) and NUMERIC(width,scale)
   if (upper.starts_with("DECIMAL")) {
     return nameToTag.at("DECIMAL");
   }
 
+  else if (upper.starts_with("NUMERIC")) {
+    return nameToTag.at("NUMERIC");
+  }
+
   else if (upper.starts_with("VARCHAR")) {
     return nameToTag.at("VARCHAR");
   }
@@ -459,7 +487,7 @@ PostgresTypeTag Type::getPostgresTag(const String &type) {
 }
 
 Opt<WidthScale> Type::getDecimalWidthScale(const String &type) {
-  std::regex decimalPattern("DECIMAL\\((\\d+),(\\d+)\\)",
+  std::regex decimalPattern("(?:DECIMAL|NUMERIC)\\((\\d+),(\\d+)\\)",
                             std::regex_constants::icase);
   std::smatch decimalMatch;
   auto strippedString = removeSpaces(type);
@@ -29,16 +29,35 @@ size_t udfCount = 1;
 String dbPlatform = "duckdb";
 Map<String, bool> optimizerPassOnMap = {
     {"SSAConstruction", true},
+    {"Inlining", true},
     {"SSADestruction", true},
     {"DeadCodeElimination", true},
     {"QueryMotion", true},
     {"MergeRegions", true},
     {"AggressiveMergeRegions", true},
     {"InstructionElimination", true},
+    {"GlobalValueNumbering", true},
+    {"LoopInvariantCodeMotion", true},
+    {"InductionVariableSimplification", true},
+    {"LoopIdiomRecognition", true},
+    {"LoopUnswitching", true},
+    {"SparseConditionalConstantPropagation", true},
     {"AggressiveInstructionElimination", true},
     {"OutliningPass", true},
+    {"CostBasedOutlining", true},
+    {"CoalesceOutlinedRegions", true},
     {"AggifyPass", true},
+    {"AggifyDecorrelation", true},
+    {"OrderedAggify", true},
+    {"AggifyEarlyExit", true},
+    {"MaterializedCursors", true},
     {"PrintOutlinedUDF", true},
+    {"MacroRegistration", true},
+    {"DeclarativeInlining", true},
+    {"RecursiveCTELowering", true},
+    {"StructuredCodeGen", true},
+    {"ExceptionFreeCodeGen", true},
+    {"RangeAnalysis", true},
     {"RemoveUnusedVariable", true}};
 
 // replace every single quote with two single quotes
@@ -59,7 +78,7 @@ static String CompilerRun(String udfString) {
 
   auto compiler = Compiler(&con, udfString, config, udfCount);
   auto res = compiler.run();
-  return "select '' as 'Transpilation Done.';";
+  return res.macros + "select '' as 'Transpilation Done.';";
 }
 
 inline String ListCompilerPassPragmaFun(ClientContext &context,
@@ -1,4 +1,5 @@
 #include "utils.hpp"
+#include <cctype>
 #include <filesystem>
 #include <yaml-cpp/yaml.h>
 
@@ -35,6 +36,58 @@ String removeSpaces(const String &str) {
   return std::regex_replace(str, spaceRegex, "");
 }
 
+Vec<Pair<std::size_t, std::size_t>> findIdentifiers(const String &text) {
+  auto isIdentifier = [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  };
+  Vec<Pair<std::size_t, std::size_t>> identifiers;
+  std::size_t i = 0;
+  while (i < text.size()) {
+    auto c = text[i];
+    if (c == '\'' || c == '"') {
+      // an escaped quote is read as two adjacent literals
+      auto end = text.find(c, i + 1);
+      if (end == String::npos) {
+        break;
+      }
+      i = end + 1;
+      continue;
+    }
+    if (!isIdentifier(c)) {
+      ++i;
+      continue;
+    }
+    auto start = i;
+    while (i < text.size() && isIdentifier(text[i])) {
+      ++i;
+    }
+    // the field or column of a qualified name
+    if (start > 0 && text[start - 1] == '.') {
+      continue;
+    }
+    identifiers.push_back({start, i - start});
+  }
+  return identifiers;
+}
+
+String substituteIdentifiers(const String &text,
+                             const Map<String, String> &values) {
+  if (values.empty()) {
+    return text;
+  }
+  String result;
+  std::size_t pos = 0;
+  for (auto &[start, length] : findIdentifiers(text)) {
+    auto name = toLower(text.substr(start, length));
+    if (values.count(name) == 0) {
+      continue;
+    }
+    result += text.substr(pos, start - pos) + "(" + values.at(name) + ")";
+    pos = start + length;
+  }
+  return result + text.substr(pos);
+}
+
 Vec<String> extractMatches(const String &text, const char *pattern,
                            std::size_t group) {
   Vec<String> res;